@@ -0,0 +1,484 @@
+/*
+Benchmarks of Joba_JbdBms components
+
+Results are printed once after start as one json object per line, e.g.
+{"bench":"getCells_16cells","ops":2000,"bytes":78000,"us":81234,"ns_per_op":40617,"bytes_per_s":960189}
+*/
+
+#include <Arduino.h>
+#include <LittleFS.h>
+
+#include <jbdbms.h>
+#include <jbdbmstcp.h>
+#include <jbdhistory.h>
+#include <jbdmqtt.h>
+#include <jbdscheduler.h>
+#include <jbdsim.h>
+#include <jbdspool.h>
+#include <jbdtelemetry.h>
+
+volatile uint32_t sink;  // keeps the compiler from optimizing benchmarked code away
+
+
+// Print one result line
+void report( const char *bench, uint32_t ops, uint32_t bytes, uint32_t us ) {
+    Serial.printf("{\"bench\":\"%s\",\"ops\":%lu,\"bytes\":%lu,\"us\":%lu,\"ns_per_op\":%lu,\"bytes_per_s\":%lu}\n",
+        bench, (unsigned long)ops, (unsigned long)bytes, (unsigned long)us, 
+        (unsigned long)(ops ? (uint64_t)us * 1000 / ops : 0),
+        (unsigned long)(us ? (uint64_t)bytes * 1000000 / us : 0));
+}
+
+
+// Checksum of a maximum size frame (32 cells)
+void bench_crc() {
+    static const uint32_t ops = 20000;
+    uint8_t data[64];
+    for( size_t i = 0; i < sizeof(data); i++ ) {
+        data[i] = i * 7;
+    }
+
+    uint32_t start = micros();
+    for( uint32_t i = 0; i < ops; i++ ) {
+        data[0] = i;
+        sink += JbdBms::genCrc(JbdBms::OK, sizeof(data), data);
+    }
+    report("genCrc", ops, ops * sizeof(data), micros() - start);
+}
+
+
+// Byte swapping of received status and cells, balance string
+void bench_decode() {
+    static const uint32_t ops = 20000;
+    JbdBmsSim sim(32, 8);
+    JbdBms::Status_t status = sim.status;
+    JbdBms::Cells_t cells = sim.cells;
+
+    uint32_t start = micros();
+    for( uint32_t i = 0; i < ops; i++ ) {
+        JbdBms::decodeStatus(status);
+        sink += status.voltage;
+    }
+    report("decodeStatus", ops, ops * sizeof(status), micros() - start);
+
+    start = micros();
+    for( uint32_t i = 0; i < ops; i++ ) {
+        JbdBms::decodeCells(cells);
+        sink += cells.voltages[31];
+    }
+    report("decodeCells", ops, ops * sizeof(cells), micros() - start);
+
+    status.balanceLow = 0x5555;
+    status.balanceHigh = 0xaaaa;
+    start = micros();
+    for( uint32_t i = 0; i < ops; i++ ) {
+        sink += JbdBms::balance(status)[i % 32];
+    }
+    report("balance", ops, ops * status.cells, micros() - start);
+
+    // Same with structures sized for a 4 cell pack
+    JbdBmsT<4, 2>::Status_t status4;
+    JbdBmsT<4, 2>::Cells_t cells4;
+    memcpy(&status4, &status, sizeof(status4));
+    memcpy(&cells4, &cells, sizeof(cells4));
+
+    start = micros();
+    for( uint32_t i = 0; i < ops; i++ ) {
+        JbdBmsT<4, 2>::decodeCells(cells4);
+        sink += cells4.voltages[3];
+    }
+    report("decodeCells_4s", ops, ops * sizeof(cells4), micros() - start);
+
+    start = micros();
+    for( uint32_t i = 0; i < ops; i++ ) {
+        sink += JbdBmsT<4, 2>::balance(status4)[i % 4];
+    }
+    report("balance_4s", ops, ops * 4, micros() - start);
+}
+
+
+// Complete transactions (request, frame parsing, checksum, decoding) with an in-memory simulated device
+void bench_execute() {
+    static const uint32_t ops = 2000;
+    static const uint8_t counts[] = { 4, 8, 16, 24, 32 };
+    char name[32];
+
+    for( size_t c = 0; c < sizeof(counts)/sizeof(*counts); c++ ) {
+        JbdBmsSim sim(counts[c], 4);
+        JbdBms jbdbms(sim, NULL, 0);
+        JbdBms::Status_t status;
+        JbdBms::Cells_t cells;
+
+        uint32_t start = micros();
+        for( uint32_t i = 0; i < ops; i++ ) {
+            sink += jbdbms.getStatus(status);
+        }
+        snprintf(name, sizeof(name), "getStatus_%ucells", counts[c]);
+        report(name, ops, ops * (7 + 23 + 2 * status.ntcs), micros() - start);
+
+        start = micros();
+        for( uint32_t i = 0; i < ops; i++ ) {
+            sink += jbdbms.getCells(cells);
+        }
+        snprintf(name, sizeof(name), "getCells_%ucells", counts[c]);
+        report(name, ops, ops * (7 + 2 * counts[c]), micros() - start);
+    }
+}
+
+
+// Mosfet command requested just when a 32 cell poll starts, at 9600 baud with default command delay:
+// worst case latency until the switch is confirmed
+void bench_mosfet() {
+    JbdBmsSim sim(32, 4, 9600);
+    JbdBms jbdbms(sim);
+    JbdScheduler scheduler(jbdbms);
+    JbdBms::Cells_t cells;
+
+    scheduler.requestMosfet(JbdBms::MOSFET_CHARGE);
+    uint32_t start = micros();
+    jbdbms.getCells(cells);  // poll that was already running
+    scheduler.handle();
+    uint32_t us = micros() - start;
+
+    if( sim.status.mosfetStatus != JbdBms::MOSFET_CHARGE || scheduler.mosfetStats().errors ) {
+        Serial.println("mosfet switch not confirmed");
+    }
+    report("mosfet_worst_case_latency", 1, 0, us);
+}
+
+
+// Append influx sized lines to the spool, then drain it in batches
+void bench_spool() {
+    static const uint32_t records = 1000;
+    static char line[] = 
+        "Status,Id=SP04S010A,Version=1.0 Host=\"Monitor_JbdBms-1\",voltage=1325,current=-1234,"
+        "remainingCapacity=8012,nominalCapacity=10000,cycles=12,fault=0,currentCapacity=80,mosfetStatus=3 1666600000";
+    static uint8_t batch[4096];
+
+    JbdSpool spool(LittleFS, "/bench", 8, 65536, 0);
+    spool.begin();
+    while( spool.batch(batch, sizeof(batch)) ) {
+        spool.commit();  // leftovers of an aborted run
+    }
+
+    uint32_t start = micros();
+    for( uint32_t i = 0; i < records; i++ ) {
+        spool.append(line, sizeof(line) - 1);
+    }
+    report("spool_append", records, records * (sizeof(line) - 1), micros() - start);
+
+    uint32_t batches = 0, bytes = 0;
+    start = micros();
+    size_t len;
+    while( (len = spool.batch(batch, sizeof(batch))) ) {
+        spool.commit();
+        batches++;
+        bytes += len;
+    }
+    report("spool_drain", batches, bytes, micros() - start);
+
+    if( spool.evicted() ) {
+        Serial.printf("spool evicted %lu segments: results include eviction\n", (unsigned long)spool.evicted());
+    }
+}
+
+
+// 24 h of history, queried at native resolution and downsampled
+#if defined(ESP8266)
+#define HISTORY_INTERVAL 240  // less ram
+#else
+#define HISTORY_INTERVAL 60
+#endif
+#define HISTORY_SIZE (86400 / HISTORY_INTERVAL)
+
+void bench_history() {
+    static JbdHistory::sample_t samples[HISTORY_SIZE];
+    static const uint32_t steps[] = { 0, 600, 3600 };
+    static const uint32_t t0 = 1666600000;
+
+    JbdHistory history(samples, HISTORY_SIZE, HISTORY_INTERVAL);
+    JbdBms::Status_t status = {0};
+    JbdBms::Cells_t cells = {0};
+    status.cells = 16;
+    status.ntcs = 2;
+    for( uint32_t t = t0; t <= t0 + 86400; t += 10 ) {
+        status.voltage = 5300 + t % 7;
+        status.current = (int16_t)(t % 2000) - 1000;
+        for( uint8_t i = 0; i < status.cells; i++ ) {
+            cells.voltages[i] = 3300 + (t + i) % 9;
+        }
+        history.add(t, status);
+        history.add(t, cells, status.cells);
+    }
+
+    for( size_t i = 0; i < sizeof(steps)/sizeof(*steps); i++ ) {
+        static const uint32_t ops = 10;
+        uint32_t points = 0;
+        uint32_t start = micros();
+        for( uint32_t op = 0; op < ops; op++ ) {
+            JbdHistory::query_t query;
+            JbdHistory::point_t point;
+            history.begin(query, history.first(), history.last(), steps[i]);
+            while( history.next(query, point) ) {
+                points++;
+            }
+        }
+        char name[32];
+        snprintf(name, sizeof(name), "history_24h_step%lu", (unsigned long)(steps[i] ? steps[i] : HISTORY_INTERVAL));
+        report(name, ops, points * sizeof(JbdHistory::point_t), micros() - start);
+    }
+}
+
+
+// Telemetry frames of status and cells (with 2 temperatures and some balancing).
+// bytes / ops is the frame size
+void bench_telemetry() {
+    static const uint32_t ops = 2000;
+    static const uint8_t counts[] = { 4, 16, 32 };
+    uint8_t frame[JbdTelemetry::MAX_FRAME];
+    char name[32];
+
+    for( size_t c = 0; c < sizeof(counts)/sizeof(*counts); c++ ) {
+        JbdBmsSim sim(counts[c], 2);
+        JbdBms::Status_t status = sim.status;
+        JbdBms::Cells_t cells = sim.cells;
+        status.current = -1234;
+        status.balanceLow = 0x0005;
+        for( uint8_t i = 0; i < counts[c]; i++ ) {
+            cells.voltages[i] = 3300 + (i * 7) % 23;  // 23 mV spread
+        }
+
+        size_t len = 0;
+        uint32_t start = micros();
+        for( uint32_t i = 0; i < ops; i++ ) {
+            status.voltage = 5300 + i % 7;
+            len = JbdTelemetry::encode(frame, sizeof(frame), &status, &cells, counts[c]);
+            sink += len;
+        }
+        snprintf(name, sizeof(name), "telemetry_encode_%ucells", counts[c]);
+        report(name, ops, ops * len, micros() - start);
+
+        uint8_t contents;
+        start = micros();
+        for( uint32_t i = 0; i < ops; i++ ) {
+            sink += JbdTelemetry::decode(frame, len, status, cells, contents);
+        }
+        snprintf(name, sizeof(name), "telemetry_decode_%ucells", counts[c]);
+        report(name, ops, ops * len, micros() - start);
+    }
+}
+
+
+// Stand-in for the TCP connection to an RS485 bridge with a simulated device behind it.
+// Stale bytes are read before the responses of the device
+class BridgeClient : public Client {
+public:
+    BridgeClient( JbdBmsSim &sim ) : written(0), _sim(sim), _connected(false), _staleLen(0), _stalePos(0) {}
+
+    uint32_t written;  // bytes sent to the bridge
+
+    void stale( const uint8_t *data, size_t len ) {
+        _staleLen = len < sizeof(_stale) ? len : sizeof(_stale);
+        memcpy(_stale, data, _staleLen);
+        _stalePos = 0;
+    }
+
+    int connect( IPAddress ip, uint16_t port ) { _connected = true; return 1; }
+    int connect( const char *host, uint16_t port ) { _connected = true; return 1; }
+    size_t write( uint8_t byte ) { return write(&byte, 1); }
+    size_t write( const uint8_t *buf, size_t size ) {
+        if( !_connected ) {
+            return 0;
+        }
+        written += size;
+        return _sim.write(buf, size);
+    }
+    int available() { return _connected ? _staleLen - _stalePos + _sim.available() : 0; }
+    int read() {
+        if( !_connected ) {
+            return -1;
+        }
+        return (_stalePos < _staleLen) ? _stale[_stalePos++] : _sim.read();
+    }
+    int read( uint8_t *buf, size_t size ) {
+        size_t len = 0;
+        int byte;
+        while( len < size && (byte = read()) >= 0 ) {
+            buf[len++] = byte;
+        }
+        return len;
+    }
+    int peek() {
+        if( !_connected ) {
+            return -1;
+        }
+        return (_stalePos < _staleLen) ? _stale[_stalePos] : _sim.peek();
+    }
+    void flush() {}
+    void stop() { _connected = false; }
+    uint8_t connected() { return _connected; }
+    operator bool() { return _connected; }
+
+private:
+    JbdBmsSim &_sim;
+    bool _connected;
+    uint8_t _stale[4 + 64 + 3];
+    size_t _staleLen;
+    size_t _stalePos;
+};
+
+// Transactions through JbdBmsTcp with a stand-in bridge. Checks the first request,
+// a request after a reconnect and a stale response in front of the expected one
+void bench_tcp() {
+    static const uint32_t ops = 2000;
+    static const uint8_t cellsRequest[] = { 0xdd, 0xa5, 0x04, 0x00, 0xff, 0xfc, 0x77 };
+    JbdBmsSim sim(16, 2);
+    BridgeClient client(sim);
+    JbdBmsTcp bridge(client, "bridge", 4001, 0);
+    JbdBms jbdbms(bridge, NULL, 0);
+    JbdBms::Status_t status;
+
+    if( !jbdbms.getStatus(status) || !client.written ) {
+        Serial.printf("tcp first request failed, %lu bytes sent\n", (unsigned long)client.written);
+    }
+
+    client.stop();  // connection lost
+    if( !jbdbms.getStatus(status) || bridge.connects() != 2 ) {
+        Serial.printf("tcp request after reconnect failed, %lu connects\n", (unsigned long)bridge.connects());
+    }
+
+    // Response of an earlier cells request still on its way
+    JbdBmsSim other(16, 2);
+    uint8_t frame[4 + 64 + 3];
+    size_t len = 0;
+    other.write(cellsRequest, sizeof(cellsRequest));
+    while( other.available() > 0 && len < sizeof(frame) ) {
+        frame[len++] = other.read();
+    }
+    client.stale(frame, len);
+    if( !jbdbms.getStatus(status) || status.cells != 16 ) {
+        Serial.println("tcp request behind a stale response failed");
+    }
+
+    uint32_t start = micros();
+    for( uint32_t i = 0; i < ops; i++ ) {
+        sink += jbdbms.getStatus(status);
+    }
+    report("tcp_getStatus_16cells", ops, ops * (7 + 23 + 2 * status.ntcs), micros() - start);
+}
+
+
+// Stand-in for the mqtt broker: counts publications and keeps the last current payload
+struct {
+    uint32_t publications;
+    uint32_t bytes;
+    char current[16];
+} broker;
+
+bool broker_publish( const char *topic, const char *payload, bool retained ) {
+    broker.publications++;
+    broker.bytes += strlen(topic) + strlen(payload);
+    if( !strcmp(topic, "bench/status/current") ) {
+        snprintf(broker.current, sizeof(broker.current), "%s", payload);
+    }
+    return true;
+}
+
+// Samples of a 16 cell pack through JbdMqtt into the stand-in broker, bytes are topics + payloads.
+// Checks that changes within the deadband are not published, that a fluctuating current is
+// published once per interval, the broker still gets its latest value and faults go out at once
+void bench_mqtt() {
+    static const uint32_t ops = 2000;
+    static const uint32_t interval = 50;  // ms
+    JbdBmsSim sim(16, 2);
+    JbdBms::Status_t status = sim.status;
+    JbdBms::Cells_t cells = sim.cells;
+    JbdMqtt jbdmqtt("bench", broker_publish, interval);
+
+    memset(&broker, 0, sizeof(broker));
+    status.current = -1000;
+    jbdmqtt.add(status);
+    jbdmqtt.add(cells, status.cells);
+    size_t first = jbdmqtt.flush();
+    if( first != JbdMqtt::TEMPERATURE + status.ntcs + status.cells ) {
+        Serial.printf("mqtt first flush published %u topics\n", (unsigned)first);
+    }
+
+    // Current +-100 mA, cells +-5 mV: within the default deadbands
+    memset(&broker, 0, sizeof(broker));
+    uint32_t start = micros();
+    for( uint32_t i = 0; i < ops; i++ ) {
+        status.current = -1000 + ((i % 2) ? 10 : -10);
+        cells.voltages[i % status.cells] = sim.cells.voltages[i % status.cells] + ((i % 2) ? 5 : -5);
+        jbdmqtt.add(status);
+        jbdmqtt.add(cells, status.cells);
+        jbdmqtt.flush();
+    }
+    report("mqtt_sample_deadband", ops, broker.bytes, micros() - start);
+    if( broker.publications || jbdmqtt.pending() ) {
+        Serial.printf("mqtt deadband published %lu topics, %u pending\n", (unsigned long)broker.publications, (unsigned)jbdmqtt.pending());
+    }
+
+    // Current steps of 1 A every sample for 4 intervals: rate limited
+    memset(&broker, 0, sizeof(broker));
+    uint32_t samples = 0;
+    uint32_t begin = millis();
+    start = micros();
+    while( millis() - begin < 4 * interval ) {
+        status.current = -1000 + (int16_t)(samples++ % 20) * 100;
+        jbdmqtt.add(status);
+        jbdmqtt.flush();
+    }
+    report("mqtt_sample_fluctuating", samples, broker.bytes, micros() - start);
+    if( broker.publications < 3 || broker.publications > 5 ) {
+        Serial.printf("mqtt interval published %lu topics in 4 intervals\n", (unsigned long)broker.publications);
+    }
+
+    delay(interval);
+    jbdmqtt.flush();
+    char latest[16];
+    snprintf(latest, sizeof(latest), "%s%d.%02d", status.current < 0 ? "-" : "", abs(status.current) / 100, abs(status.current) % 100);
+    if( jbdmqtt.pending() || strcmp(broker.current, latest) ) {
+        Serial.printf("mqtt broker has current %s instead of %s\n", broker.current, latest);
+    }
+
+    memset(&broker, 0, sizeof(broker));
+    status.fault = 0x0001;  // cell overvoltage
+    jbdmqtt.add(status);
+    jbdmqtt.flush();
+    if( broker.publications != 1 ) {
+        Serial.printf("mqtt fault published %lu topics\n", (unsigned long)broker.publications);
+    }
+}
+
+
+void setup() {
+    Serial.begin(115200);
+    delay(2000);  // time to start the serial monitor
+    Serial.println("\nStarting Bench_JbdBms " __DATE__ " " __TIME__);
+
+    bench_crc();
+    bench_decode();
+    bench_execute();
+    bench_mosfet();
+    bench_tcp();
+    bench_history();
+    bench_telemetry();
+    bench_mqtt();
+
+#if defined(ESP32)
+    bool have_fs = LittleFS.begin(true);
+#else
+    bool have_fs = LittleFS.begin();
+#endif
+    if( have_fs ) {
+        bench_spool();
+    }
+    else {
+        Serial.println("LittleFS mount failed, skip spool benchmarks");
+    }
+
+    Serial.println("Benchmarks done");
+}
+
+void loop() {
+}
@@ -0,0 +1,9 @@
+// Formats of deferred log entries (see jbdlog.h), included several times by main.cpp.
+// Ids are assigned in order. Decode syslog messages with: tools/jbdlog.py logformats.h syslog
+// Only append new formats, so older logs can still be decoded
+
+JBDLOG_FORMAT(STATUS, "status voltage=%u current=%d remainingCapacity=%u nominalCapacity=%u cycles=%u "
+    "productionDate=%04u-%02u-%02u balance=%08x fault=%04x version=%u currentCapacity=%u mosfetStatus=%u "
+    "cells=%u ntcs=%u temperatures=%d")
+JBDLOG_FORMAT(CELLS, "cells mV=%u")
+JBDLOG_FORMAT(FAULT, "fault bits %04x")
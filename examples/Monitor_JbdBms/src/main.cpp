@@ -34,9 +34,6 @@ Use pin 22 to toggle RS485 read/write
     #define WebServer ESP8266WebServer
     #define HTTPUpdateServer ESP8266HTTPUpdateServer
 
-    // Post to InfluxDB
-    #include <ESP8266HTTPClient.h>
-
     // Time sync
     #include <NTPClient.h>
     #include <WiFiUdp.h>
@@ -60,9 +57,6 @@ Use pin 22 to toggle RS485 read/write
     #include <WiFi.h>
     #include <ESPmDNS.h>
     #include <WiFiClient.h>
-
-    // Post to InfluxDB
-    #include <HTTPClient.h>
     
     // Time sync
     #include <time.h>
@@ -71,6 +65,7 @@ Use pin 22 to toggle RS485 read/write
 #endif
 
 // Infrastructure
+#include <LittleFS.h>
 #include <Syslog.h>
 #include <WiFiManager.h>
 
@@ -82,7 +77,6 @@ HTTPUpdateServer esp_updater;
 
 // Post to InfluxDB
 WiFiClient client;
-HTTPClient http;
 int influx_status = 0;
 time_t post_time = 0;
 
@@ -98,49 +92,242 @@ bool enabledBreathing = true;  // global flag to switch breathing animation on o
 #define PWMBITS 10
 #endif
 
+// Output buffers for syslog, json, influx lines and web pages.
+// Each consumer owns a buffer only while it uses it. No heap in steady state (see /json/Memory)
+#include <jbdpool.h>
+
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 768  // enough for 32 cells
+#endif
+#define BUFFERS 4        // nested use: sample line, influx request, syslog message. One for the web server
+
+char arena[BUFFERS * BUFFER_SIZE];
+JbdPool pool(arena, sizeof(arena), BUFFER_SIZE);
+uint32_t min_free_heap = UINT32_MAX;
+
 // Syslog
 WiFiUDP logUDP;
 Syslog syslog(logUDP, SYSLOG_PROTO_IETF);
-char msg[512];  // one buffer for all syslog and json messages
 char start_time[30];
 
+// Like syslog.logf(), but formats into a pool buffer instead of the heap
+void log_printf( uint16_t pri, const char *fmt, ... ) {
+    char *buffer = pool.acquire("syslog");
+    if (buffer) {
+        va_list args;
+        va_start(args, fmt);
+        vsnprintf(buffer, pool.bufferSize(), fmt, args);
+        va_end(args);
+        syslog.log(pri, buffer);
+        pool.release(buffer);
+    }
+}
+
+// Samples are logged in binary and sent to syslog a few per loop (see logformats.h)
+#include <jbdlog.h>
+
+#ifndef SYSLOG_BINARY
+#define SYSLOG_BINARY 1  // batches of hex entries for tools/jbdlog.py, 0: one text message per entry
+#endif
+#ifndef LOG_BUDGET
+#define LOG_BUDGET 2000  // us per loop for sending log messages, at least one is sent
+#endif
+#ifndef LOG_SIZE
+#if defined(ESP8266)
+#define LOG_SIZE 1024
+#else
+#define LOG_SIZE 4096
+#endif
+#endif
+
+#define JBDLOG_FORMAT(name, fmt) FMT_##name,
+enum log_format {
+#include "logformats.h"
+};
+#undef JBDLOG_FORMAT
+#define JBDLOG_FORMAT(name, fmt) fmt,
+const char *const logFormats[] = {
+#include "logformats.h"
+};
+#undef JBDLOG_FORMAT
+
+uint8_t log_ring[LOG_SIZE];
+JbdLog jbdlog(log_ring, sizeof(log_ring), logFormats, sizeof(logFormats)/sizeof(*logFormats));
+
+// Called every loop: send logged entries, as batch of hex or one formatted per message.
+// Not only in loops without a poll: while a capture is armed, every loop polls
+void handle_log() {
+    uint32_t start = micros();
+    while (!jbdlog.empty()) {
+        char *buffer = pool.acquire("jbdlog");
+        if (!buffer) {
+            return;
+        }
+        static const char prefix[] = "jbdlog ";
+        uint8_t priority;
+        bool sent = false;
+        if (SYSLOG_BINARY) {
+            strcpy(buffer, prefix);
+            if (jbdlog.encode(&buffer[sizeof(prefix) - 1], pool.bufferSize() - sizeof(prefix) + 1, priority)) {
+                syslog.log(priority, buffer);
+                sent = true;
+            }
+        }
+        else if (jbdlog.format(buffer, pool.bufferSize(), priority)) {
+            Serial.println(buffer);
+            syslog.log(priority, buffer);
+            sent = true;
+        }
+        pool.release(buffer);
+        if (!sent || micros() - start >= LOG_BUDGET) {
+            return;  // rest in the next loops
+        }
+    }
+}
+
 // JbdBms device
 #include <jbdbms.h>
+#include <jbdscheduler.h>
+#include <jbdbus.h>
+#include <jbdadaptive.h>
+#include <jbdaggregator.h>
+#include <jbdspool.h>
+#include <jbdhistory.h>
+#include <jbdcapture.h>
 
 #define RS485_DIR_PIN 22  // != -1: Use pin for explicit DE/!RE
 
 JbdBms jbdbms(rs485);  // Serial port with RS485 converter
+JbdScheduler scheduler(jbdbms);  // Polls the device (see setup_polls())
+JbdBus bus;  // Shares poll results with the consumers (see setup_subscribers())
+JbdAdaptiveRate adaptive(2000, 60000);  // Status and cells poll period depending on activity
+int statusPoll = -1, cellsPoll = -1;
+
+// Poll faster if the battery is busy, slower if it is idle
+void adapt_polls( uint32_t period ) {
+    scheduler.setPeriod(statusPoll, period);
+    scheduler.setPeriod(cellsPoll, period);
+}
 
 
-// Post data to InfluxDB
-bool postInflux(const char *line) {
+// Read response of the influx server into buffer. Return the http status code
+int influxResponse( char *buffer, size_t size ) {
+    // Status line like "HTTP/1.1 204 No Content"
+    size_t len = client.readBytesUntil('\n', buffer, size - 1);
+    buffer[len] = '\0';
+    const char *code = strchr(buffer, ' ');
+    int status = code ? atoi(code + 1) : -1;
+    *buffer = '\0';
+
+    if (status < 200 || status >= 300) {
+        // skip headers, keep start of body for the error log
+        while ((len = client.readBytesUntil('\n', buffer, size - 1)) > 1)
+            ;
+        len = 0;
+        uint32_t start = millis();
+        while (len < size - 1 && (client.connected() || client.available()) && millis() - start < 1000) {
+            int c = client.read();
+            if (c >= 0) {
+                buffer[len++] = c;
+            }
+        }
+        buffer[len] = '\0';
+    }
+    return status;
+}
+
+
+// Post lines to InfluxDB. Plain http request from a pool buffer (HTTPClient keeps host, uri and payload in Strings)
+bool sendInflux(const char *line) {
     static const char uri[] = "/write?db=" INFLUX_DB "&precision=s";
+    static const char requestFmt[] =
+        "POST %s HTTP/1.1\r\n"
+        "Host: %s:%u\r\n"
+        "User-Agent: " PROGNAME "\r\n"
+        "Content-Type: text/plain\r\n"
+        "Content-Length: %u\r\n"
+        "Connection: close\r\n"
+        "\r\n";
+
+    char *buffer = pool.acquire("influx");
+    if (!buffer) {
+        return false;
+    }
 
-    http.begin(client, INFLUX_SERVER, INFLUX_PORT, uri);
-    http.setUserAgent(PROGNAME);
-    influx_status = http.POST(line);
-    String payload;
-    if (http.getSize() > 0) { // workaround for bug in getString()
-        payload = http.getString();
+    size_t len = strlen(line);
+    influx_status = -1;  // connection failed
+    if (client.connect(INFLUX_SERVER, INFLUX_PORT)) {
+        size_t head = snprintf(buffer, pool.bufferSize(), requestFmt, uri, INFLUX_SERVER, INFLUX_PORT, len);
+        if (client.write((const uint8_t *)buffer, head) == head && client.write((const uint8_t *)line, len) == len) {
+            influx_status = influxResponse(buffer, pool.bufferSize());
+        }
+        else {
+            *buffer = '\0';  // no response
+        }
+        client.stop();
     }
-    http.end();
 
-    if (influx_status < 200 || influx_status >= 300) {
+    bool ok = influx_status >= 200 && influx_status < 300;
+    if (!ok) {
         breathe_interval = err_interval;
-        syslog.logf(LOG_ERR, "Post %s:%d%s status=%d line='%s' response='%s'",
-            INFLUX_SERVER, INFLUX_PORT, uri, influx_status, line, payload.c_str());
-        return false;
+        log_printf(LOG_ERR, "Post %s:%d%s status=%d line='%s' response='%s'",
+            INFLUX_SERVER, INFLUX_PORT, uri, influx_status, line, buffer);
+    }
+    else {
+        breathe_interval = ok_interval; // TODO mix with other possible errors
+        post_time = time(NULL);         // TODO post_time?
+    }
+
+    pool.release(buffer);
+    return ok;
+}
+
+
+// Keep lines in flash while influx is not reachable
+JbdSpool spool(LittleFS);
+
+// Post data to InfluxDB. If that fails, spool it with current time
+bool postInflux(const char *line) {
+    if (sendInflux(line)) {
+        return true;
+    }
+
+    time_t now = time(NULL);
+    char *spoolLine = pool.acquire("spool");
+    if (spoolLine && now > 1582230020) {  // valid time (see check_ntptime())
+        int len = snprintf(spoolLine, pool.bufferSize(), "%s %ld", line, (long)now);
+        if (len < pool.bufferSize() && !spool.append(spoolLine, len)) {
+            syslog.log(LOG_ERR, "Spool append failed");
+        }
     }
+    pool.release(spoolLine);
+    return false;
+}
+
 
-    breathe_interval = ok_interval; // TODO mix with other possible errors
-    post_time = time(NULL);         // TODO post_time?
-    return true;
+// Post spooled lines in batches once influx is reachable again
+void handle_spool() {
+    if (influx_status >= 200 && influx_status < 300 && !spool.empty()) {
+        char *batch = pool.acquire("spool");
+        size_t len = batch ? spool.batch((uint8_t *)batch, pool.bufferSize()) : 0;
+        if (len) {
+            batch[len - 1] = '\0';  // replace last line separator
+            if (sendInflux(batch)) {
+                spool.commit();
+            }
+        }
+        pool.release(batch);
+    }
 }
 
 
-JbdBms::Hardware_t jbdHardware = {0};
+// Id of the device for reporting, empty until the first hardware poll succeeded
+const char *bmsId() {
+    return (const char *)bus.latest(JbdBus::HARDWARE).hardware.id;
+}
+
 
-bool json_Hardware(char *json, size_t maxlen, JbdBms::Hardware_t data) {
+bool json_Hardware(char *json, size_t maxlen, const JbdBms::Hardware_t &data) {
     static const char jsonFmt[] = "{\"Version\":" VERSION ",\"Id\":\"%.32s\"}";
     int len = snprintf(json, maxlen, jsonFmt, data.id);
 
@@ -148,40 +335,90 @@ bool json_Hardware(char *json, size_t maxlen, JbdBms::Hardware_t data) {
 }
 
 
-void handle_jbdHardware() {
-    static const uint32_t interval = 600000;
-    static uint32_t prev = 0 - interval + 0;  // check at start first
+// Found a new/different JBD BMS
+void on_hardware( JbdBus::topic_t topic, bool ok, const JbdBus::snapshot_t &snapshot ) {
+    const JbdBms::Hardware_t &data = snapshot.hardware;
+    char *line = pool.acquire("hardware");
+    if (ok && line) {
+        static const char lineFmt[] =
+            "Hardware,Id=%.32s,Version=" VERSION " "
+            "Host=\"%s\"";
+
+        json_Hardware(line, pool.bufferSize(), data);
+        Serial.println(line);
+        syslog.log(LOG_INFO, line);
+        snprintf(line, pool.bufferSize(), lineFmt, (char *)data.id, WiFi.getHostname());
+        postInflux(line);
+    }
+    else if (!ok) {
+        Serial.println("getHardware error");
+    }
+    pool.release(line);
+}
 
-    uint32_t now = millis();
-    if( now - prev >= interval ) {
-        prev += interval;
-        JbdBms::Hardware_t data = {0};
-        if (jbdbms.getHardware(data)) {
-            if (strncmp((const char *)data.id, (const char *)jbdHardware.id, sizeof(data.id))) {
-                // found a new/different JBD BMS
-                static const char lineFmt[] =
-                    "Hardware,Id=%.32s,Version=" VERSION " "
-                    "Host=\"%s\"";
-
-                jbdHardware = data;
-                json_Hardware(msg, sizeof(msg), data);
-                Serial.println(msg);
-                syslog.log(LOG_INFO, msg);
-                // TODO mqtt.publish(topic, msg);
-                snprintf(msg, sizeof(msg), lineFmt, (char *)data.id, WiFi.getHostname());
-                postInflux(msg);
-            }
-        }
-        else {
-            Serial.println("getHardware error");
-        }
+
+// Window aggregates for influx
+#ifndef INFLUX_WINDOW
+#define INFLUX_WINDOW 0  // seconds, 0: post every changed sample instead
+#endif
+
+// Append fields to the influx line. If full, post it and continue in a new line with the same prefix
+void append_aggregate( char *line, size_t &len, size_t prefix, const char *name, const JbdAggregator::field_t &field ) {
+    size_t added = JbdAggregator::influxFields(&line[len], pool.bufferSize() - len, name, field);
+    if (!added && len > prefix) {
+        line[len] = '\0';
+        postInflux(line);
+        len = prefix;
+        added = JbdAggregator::influxFields(&line[len], pool.bufferSize() - len, name, field);
     }
+    len += added;
 }
 
+void post_aggregate( const JbdAggregator::aggregate_t &data ) {
+    static const char statusFmt[] =
+        "StatusAgg,Id=%.32s,Version=" VERSION ",Window=%u "
+        "Host=\"%s\",count=%u,fault=%u";
+    static const char cellsFmt[] =
+        "CellsAgg,Id=%.32s,Version=" VERSION ",Window=%u "
+        "Host=\"%s\",count=%u";
+    char name[20];
+    char *line = pool.acquire("aggregate");
+    if (!line) {
+        return;
+    }
 
-JbdBms::Status_t jbdStatus = {0};
+    size_t prefix = snprintf(line, pool.bufferSize(), statusFmt, bmsId(), INFLUX_WINDOW, WiFi.getHostname(), 
+        data.voltage.count, data.fault);
+    size_t len = prefix;
+    append_aggregate(line, len, prefix, "voltage", data.voltage);
+    append_aggregate(line, len, prefix, "current", data.current);
+    append_aggregate(line, len, prefix, "remainingCapacity", data.remainingCapacity);
+    append_aggregate(line, len, prefix, "currentCapacity", data.currentCapacity);
+    for (size_t i = 0; i < data.ntcs; i++) {
+        snprintf(name, sizeof(name), "temperature%u", i+1);
+        append_aggregate(line, len, prefix, name, data.temperatures[i]);
+    }
+    if (data.voltage.count) {
+        postInflux(line);
+    }
+
+    prefix = snprintf(line, pool.bufferSize(), cellsFmt, bmsId(), INFLUX_WINDOW, WiFi.getHostname(), 
+        data.cells[0].count);
+    len = prefix;
+    for (size_t i = 0; i < data.cellCount; i++) {
+        snprintf(name, sizeof(name), "voltage%u", i+1);
+        append_aggregate(line, len, prefix, name, data.cells[i]);
+    }
+    if (len > prefix) {
+        postInflux(line);
+    }
+    pool.release(line);
+}
 
-bool json_Status(char *json, size_t maxlen, JbdBms::Status_t data) {
+JbdAggregator aggregator(INFLUX_WINDOW * 1000, post_aggregate);
+
+
+bool json_Status(char *json, size_t maxlen, const JbdBms::Status_t &data) {
     static const char jsonFmt[] =
         "{\"Version\":" VERSION ",\"Id\":\"%.32s\",\"Status\":{"
         "\"voltage\":%u,"
@@ -208,7 +445,7 @@ bool json_Status(char *json, size_t maxlen, JbdBms::Status_t data) {
     temps[0] = '[';  // replace first comma
 
     if (len < sizeof(temps)) {
-        len = snprintf(json, maxlen, jsonFmt, jbdHardware.id,
+        len = snprintf(json, maxlen, jsonFmt, bmsId(),
             data.voltage, data.current, data.remainingCapacity, data.nominalCapacity, data.cycles, 
             JbdBms::year(data.productionDate), JbdBms::month(data.productionDate), JbdBms::day(data.productionDate), 
             JbdBms::balance(data), data.fault, data.version, 
@@ -220,76 +457,106 @@ bool json_Status(char *json, size_t maxlen, JbdBms::Status_t data) {
 }
 
 
-void handle_jbdStatus() {
-    static const uint32_t interval = 10000;
-    static uint32_t prev = 0 - interval + 600;
+// Every status sample: adapt poll rate and aggregate
+void on_status_sample( JbdBus::topic_t topic, bool ok, const JbdBus::snapshot_t &snapshot ) {
+    if (ok && bmsId()[0]) {
+        adapt_polls(adaptive.update(snapshot.status));
+        if (INFLUX_WINDOW) {
+            aggregator.add(snapshot.status);
+        }
+    }
+}
+
+
+// Log status in binary, temperatures are the repeated last argument
+void log_status( const JbdBms::Status_t &data ) {
+    uint32_t args[15 + sizeof(data.temperatures)/sizeof(*data.temperatures)] = {
+        data.voltage, (uint32_t)data.current, data.remainingCapacity, data.nominalCapacity, data.cycles,
+        JbdBms::year(data.productionDate), JbdBms::month(data.productionDate), JbdBms::day(data.productionDate),
+        (uint32_t)data.balanceHigh << 16 | data.balanceLow, data.fault, data.version,
+        data.currentCapacity, data.mosfetStatus, data.cells };
+    uint8_t count = 14;
+    args[count++] = data.ntcs;
+    for (size_t i = 0; i < data.ntcs && count < sizeof(args)/sizeof(*args); i++) {
+        args[count++] = (uint32_t)JbdBms::deciCelsius(data.temperatures[i]);
+    }
+    jbdlog.logArgs(FMT_STATUS, LOG_INFO, args, count);
+}
 
-    uint32_t now = millis();
-    if( now - prev >= interval ) {
-        prev += interval;
-        JbdBms::Status_t data = {0};
-        if (jbdbms.getStatus(data)) {
-            if (memcmp(&data, &jbdStatus, sizeof(data))) {
-                // some voltage has changed
-                static const char lineFmt[] =
-                    "Status,Id=%.32s,Version=" VERSION " "
-                    "Host=\"%s\","
-                    "voltage=%u,"
-                    "current=%d,"
-                    "remainingCapacity=%u,"
-                    "nominalCapacity=%u,"
-                    "cycles=%u,"
-                    "productionDate=\"%04u-%02u-%02u\","
-                    "balance=\"%s\","
-                    "fault=%u,"
-                    "version=%u,"
-                    "currentCapacity=%u,"
-                    "mosfetStatus=%u,"
-                    "cells=%u,"
-                    "ntcs=%u";
-
-                jbdStatus = data;
-                json_Status(msg, sizeof(msg), data);
-                Serial.println(msg);
-                syslog.log(LOG_INFO, msg);
-                // TODO mqtt.publish(topic, msg);
-                
-                size_t len = snprintf(msg, sizeof(msg), lineFmt, jbdHardware.id, WiFi.getHostname(), 
-                    data.voltage, data.current, data.remainingCapacity, data.nominalCapacity, data.cycles,
-                    JbdBms::year(data.productionDate), JbdBms::month(data.productionDate), JbdBms::day(data.productionDate), 
-                    JbdBms::balance(data), data.fault, data.version,
-                    data.currentCapacity, data.mosfetStatus, data.cells, data.ntcs);
-
-                for (size_t i = 0; i < sizeof(data.temperatures)/sizeof(*data.temperatures) && i < data.ntcs && len < sizeof(msg); i++) {
-                    char *str = &msg[len];
-                    len += snprintf(str, sizeof(msg) - len, ",temperature%u=%d", i+1, JbdBms::deciCelsius(data.temperatures[i]));
-                }
 
-                postInflux(msg);
+// Changed status: log and post it
+void on_status( JbdBus::topic_t topic, bool ok, const JbdBus::snapshot_t &snapshot ) {
+    const JbdBms::Status_t &data = snapshot.status;
+    if (!bmsId()[0]) {
+        return;  // we need the id for reporting
+    }
+    char *line = pool.acquire("status");
+    if (ok && line) {
+        static const char lineFmt[] =
+            "Status,Id=%.32s,Version=" VERSION " "
+            "Host=\"%s\","
+            "voltage=%u,"
+            "current=%d,"
+            "remainingCapacity=%u,"
+            "nominalCapacity=%u,"
+            "cycles=%u,"
+            "productionDate=\"%04u-%02u-%02u\","
+            "balance=\"%s\","
+            "fault=%u,"
+            "version=%u,"
+            "currentCapacity=%u,"
+            "mosfetStatus=%u,"
+            "cells=%u,"
+            "ntcs=%u";
+
+        log_status(data);
+        if (!INFLUX_WINDOW) {  // else influx gets window aggregates instead
+            size_t len = snprintf(line, pool.bufferSize(), lineFmt, bmsId(), WiFi.getHostname(), 
+                data.voltage, data.current, data.remainingCapacity, data.nominalCapacity, data.cycles,
+                JbdBms::year(data.productionDate), JbdBms::month(data.productionDate), JbdBms::day(data.productionDate), 
+                JbdBms::balance(data), data.fault, data.version,
+                data.currentCapacity, data.mosfetStatus, data.cells, data.ntcs);
+
+            for (size_t i = 0; i < sizeof(data.temperatures)/sizeof(*data.temperatures) && i < data.ntcs && len < pool.bufferSize(); i++) {
+                char *str = &line[len];
+                len += snprintf(str, pool.bufferSize() - len, ",temperature%u=%d", i+1, JbdBms::deciCelsius(data.temperatures[i]));
             }
-        }
-        else {
-            Serial.println("getStatus error");
+
+            postInflux(line);
         }
     }
+    else if (!ok) {
+        Serial.println("getStatus error");
+    }
+    pool.release(line);
 }
 
 
-JbdBms::Cells_t jbdCells = {0};
+// Changed fault bits: log them with priority
+void on_fault( JbdBus::topic_t topic, bool ok, const JbdBus::snapshot_t &snapshot ) {
+    jbdlog.log(FMT_FAULT, snapshot.status.fault ? LOG_WARNING : LOG_NOTICE, snapshot.status.fault);
+}
 
-bool json_Cells(char *json, size_t maxlen, JbdBms::Cells_t data) {
+
+// Number of valid cells from the latest status
+uint8_t cellCount() {
+    return bus.latest(JbdBus::STATUS).status.cells;
+}
+
+
+bool json_Cells(char *json, size_t maxlen, const JbdBms::Cells_t &data, uint8_t count) {
     static const char jsonFmt[] = "{\"Version\":" VERSION ",\"Id\":\"%.32s\",\"Cells\":%s]}";
     char voltages[sizeof(data.voltages)/sizeof(*data.voltages) * 6 + 1] = "[";
     int len = 0;
 
-    for (size_t i = 0; i < jbdStatus.cells && i < sizeof(data.voltages)/sizeof(*data.voltages) && len < sizeof(voltages); i++) {
+    for (size_t i = 0; i < count && i < sizeof(data.voltages)/sizeof(*data.voltages) && len < sizeof(voltages); i++) {
         char *str = &voltages[len];
         len += snprintf(str, sizeof(voltages) - len, ",%u", data.voltages[i]);
     }
     voltages[0] = '[';  // replace first comma
 
     if (len < sizeof(voltages)) {
-        len = snprintf(json, maxlen, jsonFmt, jbdHardware.id, voltages);
+        len = snprintf(json, maxlen, jsonFmt, bmsId(), voltages);
 
         return len < maxlen;
     }
@@ -297,44 +564,342 @@ bool json_Cells(char *json, size_t maxlen, JbdBms::Cells_t data) {
 }
 
 
-void handle_jbdCells() {
-    static const uint32_t interval = 10000;
-    static uint32_t prev = 0 - interval + 700;  // after handle_jbdStatus() so we have valid jbdStatus.cells
+// Every cells sample: adapt poll rate and aggregate
+void on_cells_sample( JbdBus::topic_t topic, bool ok, const JbdBus::snapshot_t &snapshot ) {
+    if (ok && bmsId()[0] && cellCount()) {
+        adapt_polls(adaptive.update(snapshot.cells, cellCount()));
+        if (INFLUX_WINDOW) {
+            aggregator.add(snapshot.cells, cellCount());
+        }
+    }
+}
 
-    uint32_t now = millis();
-    if( now - prev >= interval ) {
-        prev += interval;
-        JbdBms::Cells_t data = {0};
-        if (jbdbms.getCells(data)) {
-            if (memcmp(&data, &jbdCells, sizeof(data))) {
-                // some voltage has changed
-                static const char lineFmt[] =
-                    "Cells,Id=%.32s,Version=" VERSION " "
-                    "Host=\"%s\"";
-
-                jbdCells = data;
-                json_Cells(msg, sizeof(msg), data);
-                Serial.println(msg);
-                syslog.log(LOG_INFO, msg);
-                // TODO mqtt.publish(topic, msg);
-                size_t len = snprintf(msg, sizeof(msg), lineFmt, jbdHardware.id, WiFi.getHostname());
-                for (size_t i=0; i < sizeof(data.voltages)/sizeof(*data.voltages) && len < sizeof(msg) && i < jbdStatus.cells; i++) {
-                    char *str = &msg[len];
-                    len += snprintf(str, sizeof(msg) - len, ",voltage%u=%u", i+1, data.voltages[i]);
-                }
-                postInflux(msg);
+
+// Changed cell voltages: log and post them
+void on_cells( JbdBus::topic_t topic, bool ok, const JbdBus::snapshot_t &snapshot ) {
+    const JbdBms::Cells_t &data = snapshot.cells;
+    uint8_t count = cellCount();
+    if (!bmsId()[0] || !count) {
+        return;  // we need the id and number of cells for reporting
+    }
+    char *line = pool.acquire("cells");
+    if (ok && line) {
+        static const char lineFmt[] =
+            "Cells,Id=%.32s,Version=" VERSION " "
+            "Host=\"%s\"";
+
+        jbdlog.logArray(FMT_CELLS, LOG_INFO, data.voltages, count);
+        if (!INFLUX_WINDOW) {  // else influx gets window aggregates instead
+            size_t len = snprintf(line, pool.bufferSize(), lineFmt, bmsId(), WiFi.getHostname());
+            for (size_t i=0; i < sizeof(data.voltages)/sizeof(*data.voltages) && len < pool.bufferSize() && i < count; i++) {
+                char *str = &line[len];
+                len += snprintf(str, pool.bufferSize() - len, ",voltage%u=%u", i+1, data.voltages[i]);
             }
+            postInflux(line);
         }
-        else {
-            Serial.println("getCells error");
+    }
+    else if (!ok) {
+        Serial.println("getCells error");
+    }
+    pool.release(line);
+}
+
+
+// Recent samples for /history
+#ifndef HISTORY_INTERVAL
+#define HISTORY_INTERVAL 60  // seconds per stored sample
+#endif
+#ifndef HISTORY_SIZE
+#if defined(ESP8266)
+#define HISTORY_SIZE 240     // 4 h, 5 kB
+#else
+#define HISTORY_SIZE 1440    // 24 h, 29 kB
+#endif
+#endif
+
+JbdHistory::sample_t history_samples[HISTORY_SIZE];
+JbdHistory history(history_samples, HISTORY_SIZE, HISTORY_INTERVAL);
+
+void on_history( JbdBus::topic_t topic, bool ok, const JbdBus::snapshot_t &snapshot ) {
+    time_t now = time(NULL);
+    if (ok && now > 1582230020) {  // valid time (see check_ntptime())
+        if (topic == JbdBus::STATUS) {
+            history.add(now, snapshot.status);
+        }
+        else if (cellCount()) {
+            history.add(now, snapshot.cells, cellCount());
         }
     }
 }
 
 
-// Standard web page
-const char *main_page( const char *body ) {
-    static const char fmt[] =
+// MQTT: status fields and cell voltages as retained topics, published on relevant changes (JbdMqtt)
+#include <PubSubClient.h>
+#include <jbdmqtt.h>
+
+#ifndef MQTT_RETRY
+#define MQTT_RETRY 60000  // ms between connect attempts, connect blocks while the broker is down
+#endif
+
+// Client that collects the packets of several publications and sends them together
+class BatchClient : public Client {
+public:
+    BatchClient( Client &client ) : _client(client), _len(0), _batching(false) {}
+
+    void begin() { _batching = true; }
+    void end() { send(); _batching = false; }
+
+    size_t write( uint8_t byte ) { return write(&byte, 1); }
+    size_t write( const uint8_t *buf, size_t size ) {
+        if (!_batching || size > sizeof(_buffer)) {
+            send();
+            return _client.write(buf, size);
+        }
+        if (_len + size > sizeof(_buffer)) {
+            send();
+        }
+        memcpy(&_buffer[_len], buf, size);
+        _len += size;
+        return size;
+    }
+
+    int connect( IPAddress ip, uint16_t port ) { return _client.connect(ip, port); }
+    int connect( const char *host, uint16_t port ) { return _client.connect(host, port); }
+    int available() { return _client.available(); }
+    int read() { return _client.read(); }
+    int read( uint8_t *buf, size_t size ) { return _client.read(buf, size); }
+    int peek() { return _client.peek(); }
+    void flush() { send(); _client.flush(); }
+    void stop() { _len = 0; _client.stop(); }
+    uint8_t connected() { return _client.connected(); }
+    operator bool() { return _client.connected(); }
+
+private:
+    void send() {
+        if (_len) {
+            _client.write(_buffer, _len);
+            _len = 0;
+        }
+    }
+
+    Client &_client;
+    uint8_t _buffer[1460];  // one TCP segment
+    size_t _len;
+    bool _batching;
+};
+
+WiFiClient mqttClient;
+BatchClient mqttBatch(mqttClient);
+PubSubClient mqtt(mqttBatch);
+
+bool mqtt_publish( const char *topic, const char *payload, bool retained ) {
+    return mqtt.publish(topic, payload, retained);
+}
+
+JbdMqtt jbdmqtt(MQTT_TOPIC, mqtt_publish);
+
+// Publish pending topics in as few packets as possible
+void mqtt_flush() {
+    if (jbdmqtt.pending() && mqtt.connected()) {
+        mqttBatch.begin();
+        jbdmqtt.flush();
+        mqttBatch.end();
+    }
+}
+
+// Every sample: JbdMqtt decides what is worth publishing
+void on_mqtt( JbdBus::topic_t topic, bool ok, const JbdBus::snapshot_t &snapshot ) {
+    if (!ok) {
+        return;
+    }
+    if (topic == JbdBus::STATUS) {
+        jbdmqtt.add(snapshot.status);
+    }
+    else if (cellCount()) {
+        jbdmqtt.add(snapshot.cells, cellCount());
+    }
+    mqtt_flush();
+}
+
+// Keep the broker connection and publish rate limited values when they are due
+void handle_mqtt() {
+    static uint32_t prev = 0;
+    static bool tried = false;
+
+    if (!mqtt.connected()) {
+        uint32_t now = millis();
+        if (!tried || now - prev >= MQTT_RETRY) {
+            tried = true;
+            prev = now;
+            if (mqtt.connect(WiFi.getHostname())) {
+                jbdmqtt.invalidate();  // broker may have lost retained topics
+                log_printf(LOG_NOTICE, "Connected to mqtt %s:%d as %s", MQTT_SERVER, MQTT_PORT, MQTT_TOPIC);
+            }
+        }
+        return;
+    }
+
+    mqtt.loop();
+    mqtt_flush();
+}
+
+
+// Consumers of the polled samples. New ones (mqtt, display...) only need a line here
+void setup_subscribers() {
+    bus.subscribe(JbdBus::HARDWARE, on_hardware, true);
+    bus.subscribe(JbdBus::STATUS, on_status_sample);
+    bus.subscribe(JbdBus::STATUS, on_status, true);
+    bus.subscribe(JbdBus::FAULT, on_fault);
+    bus.subscribe(JbdBus::CELLS, on_cells_sample);
+    bus.subscribe(JbdBus::CELLS, on_cells, true);
+    bus.subscribe(JbdBus::STATUS, on_history);
+    bus.subscribe(JbdBus::CELLS, on_history);
+    bus.subscribe(JbdBus::STATUS, on_mqtt);
+    bus.subscribe(JbdBus::CELLS, on_mqtt);
+}
+
+
+// Scheduler statistics of each poll (jitter in ms)
+bool json_Polls(char *json, size_t maxlen) {
+    static const char pollFmt[] = 
+        "%c{\"command\":%u,\"period\":%u,\"runs\":%u,\"errors\":%u,\"misses\":%u,\"avgJitter\":%u,\"maxJitter\":%u}";
+    size_t len = snprintf(json, maxlen, "{\"Version\":" VERSION ",\"Polls\":");
+
+    for (size_t id = 0; id < scheduler.polls() && len < maxlen; id++) {
+        const JbdScheduler::stats_t &stats = scheduler.stats(id);
+        len += snprintf(&json[len], maxlen - len, pollFmt, id ? ',' : '[', 
+            scheduler.command(id), scheduler.getPeriod(id), stats.runs, stats.errors, stats.misses, 
+            stats.runs ? stats.sumJitter / stats.runs : 0, stats.maxJitter);
+    }
+    if (len < maxlen) {
+        const JbdScheduler::mosfet_stats_t &stats = scheduler.mosfetStats();
+        len += snprintf(&json[len], maxlen - len, "%s],\"Mosfet\":{\"runs\":%u,\"errors\":%u,\"lastLatency\":%u,\"maxLatency\":%u}}", 
+            scheduler.polls() ? "" : "[", stats.runs, stats.errors, stats.lastLatency, stats.maxLatency);
+    }
+
+    return len < maxlen;
+}
+
+
+// Burst capture: status and cells every CAPTURE_PERIOD while armed and as fast as the bus allows
+// after a fault, cell voltage or current step trigger, frozen around the trigger
+#ifndef CAPTURE_SIZE
+#if defined(ESP8266)
+#define CAPTURE_SIZE 40   // records of 70 bytes
+#else
+#define CAPTURE_SIZE 200  // about 75 s before and a burst of 50 records after the trigger
+#endif
+#endif
+#ifndef CAPTURE_PERIOD
+#define CAPTURE_PERIOD 1000  // ms while armed. Back to back polls would block every loop for a transaction
+#endif
+
+JbdCapture::record_t capture_records[CAPTURE_SIZE];
+JbdCapture capture(capture_records, CAPTURE_SIZE, CAPTURE_SIZE / 4);
+int captureStatusPoll = -1, captureCellsPoll = -1;
+
+// Poll period for the capture state: back to back only in the post-trigger window, paused while frozen
+void capture_polls() {
+    static const uint32_t paused = 3600000;
+    JbdCapture::state_t state = capture.state();
+    uint32_t period = (state == JbdCapture::ARMED) ? CAPTURE_PERIOD : (state == JbdCapture::TRIGGERED) ? 0 : paused;
+    if (period != scheduler.getPeriod(captureStatusPoll)) {
+        scheduler.setPeriod(captureStatusPoll, period, state == JbdCapture::TRIGGERED);
+        scheduler.setPeriod(captureCellsPoll, period, state == JbdCapture::TRIGGERED);
+    }
+}
+
+void handle_capture( JbdBms::cmd_t command, bool ok, const JbdScheduler::data_t &result ) {
+    if (!ok || capture.state() == JbdCapture::FROZEN) {
+        return;
+    }
+    if (command == JbdBms::STATUS) {
+        capture.add(result.status);
+    }
+    else if (cellCount()) {
+        capture.add(result.cells, cellCount());
+    }
+    capture_polls();
+    if (capture.state() == JbdCapture::FROZEN) {
+        log_printf(LOG_WARNING, "Capture triggered by %s, %u records at /capture", 
+            JbdCapture::reasonName(capture.reason()), capture.records());
+    }
+}
+
+// LiFePO limits: any new fault, cells above 3.65 V or below 2.5 V, current steps of 20 A
+void setup_capture() {
+    capture.setTriggers(0xffff, 3650, 2500, 2000);
+    capture.arm();
+    captureStatusPoll = scheduler.add(JbdBms::STATUS, CAPTURE_PERIOD, 0, 1000, handle_capture);
+    captureCellsPoll = scheduler.add(JbdBms::CELLS, CAPTURE_PERIOD, 0, 1000, handle_capture);
+}
+
+
+// Buffer use and heap state. The heap should stay stable over days
+bool json_Memory(char *json, size_t maxlen) {
+    static const char jsonFmt[] =
+        "{\"Version\":" VERSION ",\"Memory\":{"
+        "\"buffers\":%u,\"bufferSize\":%u,\"used\":%u,\"highWater\":%u,\"failures\":%u,"
+        "\"freeHeap\":%u,\"minFreeHeap\":%u,\"maxBlock\":%u,"
+        "\"log\":{\"size\":%u,\"used\":%u,\"logged\":%u,\"dropped\":%u},\"owners\":[";
+#if defined(ESP8266)
+    uint32_t maxBlock = ESP.getMaxFreeBlockSize();
+#else
+    uint32_t maxBlock = ESP.getMaxAllocHeap();
+#endif
+    size_t len = snprintf(json, maxlen, jsonFmt, pool.buffers(), pool.bufferSize(), pool.used(), 
+        pool.highWater(), pool.failures(), ESP.getFreeHeap(), min_free_heap, maxBlock,
+        jbdlog.size(), jbdlog.used(), jbdlog.logged(), jbdlog.dropped());
+
+    const char *sep = "";
+    for (size_t i = 0; i < pool.buffers() && len < maxlen; i++) {
+        if (pool.owner(i)) {
+            len += snprintf(&json[len], maxlen - len, "%s\"%s\"", sep, pool.owner(i));
+            sep = ",";
+        }
+    }
+    if (len < maxlen) {
+        len += snprintf(&json[len], maxlen - len, "]}}");
+    }
+
+    return len < maxlen;
+}
+
+
+// Track lowest free heap
+void handle_memory() {
+    uint32_t free_heap = ESP.getFreeHeap();
+    if (free_heap < min_free_heap) {
+        min_free_heap = free_heap;
+    }
+}
+
+
+// Send content of known length without copying it into a String
+void web_send( int code, const char *type, const char *content, size_t len ) {
+    web_server.setContentLength(len);
+    web_server.send(code, type, "");
+    web_server.sendContent(content, len);
+}
+
+
+// Send json from a pool buffer
+void web_json( bool (*json_function)(char *json, size_t maxlen) ) {
+    char *json = pool.acquire("web");
+    if (json) {
+        json_function(json, pool.bufferSize());
+        web_send(200, "application/json", json, strlen(json));
+        pool.release(json);
+    }
+    else {
+        web_send(503, "text/plain", "busy", 4);
+    }
+}
+
+
+// Standard web page, sent in chunks: dynamic parts from a pool buffer, the rest directly from flash
+void send_page( int code, const char *body ) {
+    static const char headFmt[] =
         "<html>\n"
         " <head>\n"
         "  <title>" PROGNAME " %.32s v" VERSION "</title>\n"
@@ -347,16 +912,25 @@ const char *main_page( const char *body ) {
         "    <td><input type=\"checkbox\" name=\"discharge\" id=\"discharge\" value=\"Discharge\" %s/><label for=\"discharge\">Discharge</label></td>\n"
         "    <td><input type=\"submit\" name=\"mosfets\" value=\"Set Mosfets\" />\n"
         "  </tr></form></table></p>\n"
-        "  <p><strong>%s</strong></p>\n"
+        "  <p><strong>%s</strong></p>\n";
+    static const char links[] =
         "  <p><table>\n"
         "   <tr><td>Status</td><td><a href=\"/json/Status\">JSON</a></td></tr>\n"
         "   <tr><td>Cells</td><td><a href=\"/json/Cells\">JSON</a></td></tr>\n"
+        "   <tr><td>Polls</td><td><a href=\"/json/Polls\">JSON</a></td></tr>\n"
+        "   <tr><td>Memory</td><td><a href=\"/json/Memory\">JSON</a></td></tr>\n"
+        "   <tr><td>History (24h, 10 min steps)</td><td><a href=\"/history?step=600\">JSON</a></td></tr>\n";
+    static const char infoFmt[] =
+        "   <tr><td>Capture (%s)</td><td><a href=\"/capture\">JSON</a></td><td><form action=\"capture\" method=\"post\">"
+        "<input type=\"submit\" name=\"arm\" value=\"Arm\" /><input type=\"submit\" name=\"trigger\" value=\"Trigger\" /></form></td></tr>\n"
         "   <tr><td>Post firmware image to</td><td><a href=\"/update\">/update</a></td></tr>\n"
         "   <tr><td>Last start time</td><td>%s</td></tr>\n"
         "   <tr><td>Last web update</td><td>%s</td></tr>\n"
         "   <tr><td>Last influx update</td><td>%s</td></tr>\n"
         "   <tr><td>Influx status</td><td>%d</td></tr>\n"
-        "  </table></p>\n"
+        "   <tr><td>Buffers used (max)</td><td>%u (%u) of %u</td></tr>\n"
+        "  </table></p>\n";
+    static const char tail[] =
         "  <p><table><tr>\n"
         "   <td><form action=\"/\" method=\"get\">\n"
         "    <input type=\"submit\" name=\"reload\" value=\"Reload\" />\n"
@@ -370,17 +944,152 @@ const char *main_page( const char *body ) {
         "  </tr></table></p>\n"
         " </body>\n"
         "</html>\n";
-    static char page[sizeof(fmt) + 500] = "";
-    static char curr_time[30], influx_time[30];
+
+    char *page = pool.acquire("web");
+    if (!page) {
+        web_send(503, "text/plain", "busy", 4);
+        return;
+    }
+
+    char curr_time[30], influx_time[30];
     time_t now;
     time(&now);
     strftime(curr_time, sizeof(curr_time), "%FT%T%Z", localtime(&now));
     strftime(influx_time, sizeof(influx_time), "%FT%T%Z", localtime(&post_time));
-    snprintf(page, sizeof(page), fmt, jbdHardware.id, jbdHardware.id, 
-        jbdStatus.mosfetStatus & JbdBms::MOSFET_CHARGE ? "checked " : "", 
-        jbdStatus.mosfetStatus & JbdBms::MOSFET_DISCHARGE ? "checked " : "", 
-        body, start_time, curr_time, influx_time, influx_status);
-    return page;
+    uint8_t mosfetStatus = bus.latest(JbdBus::STATUS).status.mosfetStatus;
+
+    web_server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    web_server.send(code, "text/html", "");
+    size_t len = snprintf(page, pool.bufferSize(), headFmt, bmsId(), bmsId(), 
+        mosfetStatus & JbdBms::MOSFET_CHARGE ? "checked " : "", 
+        mosfetStatus & JbdBms::MOSFET_DISCHARGE ? "checked " : "", 
+        body);
+    web_server.sendContent(page, len < pool.bufferSize() ? len : pool.bufferSize() - 1);
+    web_server.sendContent(links, sizeof(links) - 1);
+    len = snprintf(page, pool.bufferSize(), infoFmt, JbdCapture::stateName(capture.state()), start_time, curr_time, influx_time, influx_status,
+        pool.used(), pool.highWater(), pool.buffers());
+    web_server.sendContent(page, len < pool.bufferSize() ? len : pool.bufferSize() - 1);
+    web_server.sendContent(tail, sizeof(tail) - 1);
+    web_server.sendContent(tail, 0);  // end of chunks
+
+    pool.release(page);
+}
+
+
+// Stream downsampled history as json: /history?from=&to=&step= (unix times, seconds)
+// Default is the last 24 h in steps of HISTORY_INTERVAL. Points are formatted into one pool buffer 
+// that is sent as a chunk whenever it is full. queryUs is the time spent in the history index and
+// downsampling, totalMs includes formatting and sending
+void send_history() {
+    static const char headFmt[] =
+        "{\"Version\":" VERSION ",\"Id\":\"%.32s\",\"from\":%lu,\"to\":%lu,\"step\":%lu,"
+        "\"fields\":[\"time\",\"count\",\"voltage\",\"current\",\"temperature\",\"remainingCapacity\","
+        "\"currentCapacity\",\"mosfetStatus\",\"fault\",\"minCell\",\"maxCell\"],\"points\":[";
+    static const char pointFmt[] = "%s[%lu,%u,%u,%d,%d,%u,%u,%u,%u,%u,%u]";
+    static const size_t maxPoint = 80;  // formatted length of one point
+
+    uint32_t start = micros();
+    uint32_t to = web_server.hasArg("to") ? web_server.arg("to").toInt() : time(NULL);
+    uint32_t from = web_server.hasArg("from") ? web_server.arg("from").toInt() : to - 86400;
+    uint32_t step = web_server.hasArg("step") ? web_server.arg("step").toInt() : 0;
+    if (!step) {
+        step = history.interval();
+    }
+
+    char *chunk = pool.acquire("history");
+    if (!chunk) {
+        web_send(503, "text/plain", "busy", 4);
+        return;
+    }
+
+    web_server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    web_server.send(200, "application/json", "");
+    size_t len = snprintf(chunk, pool.bufferSize(), headFmt, bmsId(), (unsigned long)from, (unsigned long)to, (unsigned long)step);
+
+    JbdHistory::query_t query;
+    JbdHistory::point_t point;
+    uint32_t queryStart = micros();
+    history.begin(query, from, to, step);
+    uint32_t queryUs = micros() - queryStart;
+    const char *sep = "";
+    while (true) {
+        queryStart = micros();
+        bool found = history.next(query, point);
+        queryUs += micros() - queryStart;
+        if (!found) {
+            break;
+        }
+        if (len + maxPoint > pool.bufferSize()) {
+            web_server.sendContent(chunk, len);
+            len = 0;
+        }
+        len += snprintf(&chunk[len], pool.bufferSize() - len, pointFmt, sep, (unsigned long)point.time, point.count,
+            point.voltage, point.current, point.temperature, point.remainingCapacity, point.currentCapacity,
+            point.mosfetStatus, point.fault, point.minCell, point.maxCell);
+        sep = ",";
+    }
+    if (len + maxPoint > pool.bufferSize()) {
+        web_server.sendContent(chunk, len);
+        len = 0;
+    }
+    len += snprintf(&chunk[len], pool.bufferSize() - len, "],\"queryUs\":%lu,\"totalMs\":%lu}", 
+        (unsigned long)queryUs, (unsigned long)((micros() - start) / 1000));
+    web_server.sendContent(chunk, len);
+    web_server.sendContent(chunk, 0);  // end of chunks
+
+    pool.release(chunk);
+}
+
+
+// Stream the capture as json, times in ms relative to the trigger (or to now if not triggered)
+void send_capture() {
+    static const char headFmt[] =
+        "{\"Version\":" VERSION ",\"Id\":\"%.32s\",\"state\":\"%s\",\"reason\":\"%s\",\"triggerIndex\":%u,"
+        "\"fields\":{\"3\":[\"ms\",\"command\",\"voltage\",\"current\",\"fault\",\"mosfetStatus\",\"currentCapacity\",\"temperatures\"],"
+        "\"4\":[\"ms\",\"command\",\"voltages\"]},\"records\":[";
+    static const size_t maxRecord = 32 * 6 + 20;  // formatted length of a 32 cells record
+
+    char *chunk = pool.acquire("capture");
+    if (!chunk) {
+        web_send(503, "text/plain", "busy", 4);
+        return;
+    }
+
+    web_server.setContentLength(CONTENT_LENGTH_UNKNOWN);
+    web_server.send(200, "application/json", "");
+    size_t len = snprintf(chunk, pool.bufferSize(), headFmt, bmsId(), JbdCapture::stateName(capture.state()),
+        JbdCapture::reasonName(capture.reason()), capture.triggerIndex());
+
+    uint32_t reference = capture.reason() == JbdCapture::NONE ? millis() : capture.triggerTime();
+    for (size_t i = 0; i < capture.records(); i++) {
+        const JbdCapture::record_t &record = capture.record(i);
+        if (len + maxRecord > pool.bufferSize()) {
+            web_server.sendContent(chunk, len);
+            len = 0;
+        }
+        len += snprintf(&chunk[len], pool.bufferSize() - len, "%s[%ld,%u", i ? "," : "", 
+            (long)(int32_t)(record.time - reference), record.command);
+        if (record.command == JbdBms::STATUS) {
+            const JbdBms::Status_t &status = record.status;
+            len += snprintf(&chunk[len], pool.bufferSize() - len, ",%u,%d,%u,%u,%u,[", status.voltage, status.current, 
+                status.fault, status.mosfetStatus, status.currentCapacity);
+            for (size_t t = 0; t < status.ntcs && t < sizeof(status.temperatures)/sizeof(*status.temperatures); t++) {
+                len += snprintf(&chunk[len], pool.bufferSize() - len, "%s%d", t ? "," : "", JbdBms::deciCelsius(status.temperatures[t]));
+            }
+        }
+        else {
+            len += snprintf(&chunk[len], pool.bufferSize() - len, ",[");
+            for (size_t c = 0; c < record.count; c++) {
+                len += snprintf(&chunk[len], pool.bufferSize() - len, "%s%u", c ? "," : "", record.cells.voltages[c]);
+            }
+        }
+        len += snprintf(&chunk[len], pool.bufferSize() - len, "]]");
+    }
+    len += snprintf(&chunk[len], pool.bufferSize() - len, "]}");
+    web_server.sendContent(chunk, len);
+    web_server.sendContent(chunk, 0);  // end of chunks
+
+    pool.release(chunk);
 }
 
 
@@ -390,15 +1099,16 @@ void setup_webserver() {
         uint8_t mosfetStatus = 0;
         const char *msg = "Mosfet status unchanged";
 
-        if (web_server.hasArg("charge") && web_server.arg("charge") == "Charge") {
+        if (web_server.hasArg("charge")) {  // only checked boxes are posted
             mosfetStatus |= JbdBms::MOSFET_CHARGE;
         }
-        if (web_server.hasArg("discharge") && web_server.arg("discharge") == "Discharge") {
+        if (web_server.hasArg("discharge")) {
             mosfetStatus |= JbdBms::MOSFET_DISCHARGE;
         }
-        if (mosfetStatus != jbdStatus.mosfetStatus) {
-            if (jbdbms.setMosfetStatus((JbdBms::mosfet_t)mosfetStatus)) {
-                jbdStatus.mosfetStatus = mosfetStatus;
+        if (mosfetStatus != bus.latest(JbdBus::STATUS).status.mosfetStatus) {
+            JbdBms::Status_t data = {0};
+            if (scheduler.setMosfet((JbdBms::mosfet_t)mosfetStatus, data)) {
+                // the confirming status read is published to the bus
                 switch (mosfetStatus) {
                     case JbdBms::MOSFET_NONE:
                         msg = "Charge and discharge OFF";
@@ -417,88 +1127,114 @@ void setup_webserver() {
             else {
                 msg = "Set mosfet status failed";
             }
+            char confirmed[80];
+            snprintf(confirmed, sizeof(confirmed), "%s (after %u ms)", msg, scheduler.mosfetStats().lastLatency);
+            send_page(200, confirmed);
+            return;
         }
 
-        web_server.send(200, "text/html", main_page(msg)); 
+        send_page(200, msg);
     });
 
 
     web_server.on("/json/Status", []() {
-        json_Status(msg, sizeof(msg), jbdStatus);
-        web_server.send(200, "application/json", msg);
+        web_json([](char *json, size_t maxlen) { return json_Status(json, maxlen, bus.latest(JbdBus::STATUS).status); });
     });
 
     web_server.on("/json/Cells", []() {
-        json_Cells(msg, sizeof(msg), jbdCells);
-        web_server.send(200, "application/json", msg);
+        web_json([](char *json, size_t maxlen) { return json_Cells(json, maxlen, bus.latest(JbdBus::CELLS).cells, cellCount()); });
+    });
+
+    web_server.on("/json/Polls", []() {
+        web_json(json_Polls);
+    });
+
+    web_server.on("/json/Memory", []() {
+        web_json(json_Memory);
+    });
+
+    web_server.on("/history", send_history);
+
+    web_server.on("/capture", HTTP_GET, send_capture);
+
+    // Arm the capture again or trigger it now (with argument trigger)
+    web_server.on("/capture", HTTP_POST, []() {
+        if (web_server.hasArg("trigger")) {
+            capture.trigger();
+        }
+        else {
+            capture.arm();
+        }
+        capture_polls();
+        send_page(200, JbdCapture::stateName(capture.state()));
     });
 
 
     // Call this page to reset the ESP
     web_server.on("/reset", HTTP_POST, []() {
+        static const char page[] =
+            "<html>\n"
+            " <head>\n"
+            "  <title>" PROGNAME " v" VERSION "</title>\n"
+            "  <meta http-equiv=\"refresh\" content=\"7; url=/\"> \n"
+            " </head>\n"
+            " <body>Resetting...</body>\n"
+            "</html>\n";
         syslog.log(LOG_NOTICE, "RESET");
-        web_server.send(200, "text/html",
-                        "<html>\n"
-                        " <head>\n"
-                        "  <title>" PROGNAME " v" VERSION "</title>\n"
-                        "  <meta http-equiv=\"refresh\" content=\"7; url=/\"> \n"
-                        " </head>\n"
-                        " <body>Resetting...</body>\n"
-                        "</html>\n");
+        web_send(200, "text/html", page, sizeof(page) - 1);
         delay(200);
         ESP.restart();
     });
 
     // Index page
     web_server.on("/", []() { 
-        web_server.send(200, "text/html", main_page(""));
+        send_page(200, "");
     });
 
     // Toggle breathing status led if you dont like it or ota does not work
     web_server.on("/breathe", HTTP_POST, []() {
         enabledBreathing = !enabledBreathing; 
-        web_server.send(200, "text/html", main_page(enabledBreathing ? "breathing enabled" : "breathing disabled")); 
+        send_page(200, enabledBreathing ? "breathing enabled" : "breathing disabled");
     });
 
     web_server.on("/breathe", HTTP_GET, []() {
-        web_server.send(200, "text/html", main_page(enabledBreathing ? "breathing enabled" : "breathing disabled")); 
+        send_page(200, enabledBreathing ? "breathing enabled" : "breathing disabled");
     });
 
     // Catch all page
     web_server.onNotFound( []() { 
-        web_server.send(404, "text/html", main_page("<h2>page not found</h2>\n")); 
+        send_page(404, "<h2>page not found</h2>\n");
     });
 
     web_server.begin();
 
     MDNS.addService("http", "tcp", WEBSERVER_PORT);
-    syslog.logf(LOG_NOTICE, "Serving HTTP on port %d", WEBSERVER_PORT);
+    log_printf(LOG_NOTICE, "Serving HTTP on port %d", WEBSERVER_PORT);
 }
 
 
 // toggle charge mosfet on key press
 // pin is pulled up if released and pulled down if pressed
+// Debounce by time, not by number of calls: a loop with a poll takes about 100 ms
 void handle_load_button( bool loadOn ) {
-    static uint32_t prevTime = 0;
-    static uint32_t debounceStatus = 1;
+    static const uint32_t debounce = 64;  // ms the pin must keep its level
+    static uint32_t changed = 0;  // time of last level change
+    static bool level = false;    // pin is low
     static bool pressed = false;
 
     uint32_t now = millis();
-    if( now - prevTime > 2 ) {  // debounce check every 2 ms, decision after 2ms/bit * 32bit = 64ms
-        prevTime = now;
-
-        // shift bits left, set lowest bit if button pressed
-        debounceStatus = (debounceStatus << 1) | ((digitalRead(LOAD_BUTTON_PIN) == LOW) ? 1 : 0);
-
-        if( debounceStatus == 0 && pressed ) {
-            pressed = false;
-        }
-        else if( debounceStatus == 0xffffffff && !pressed ) {
-            pressed = true;
+    bool low = digitalRead(LOAD_BUTTON_PIN) == LOW;
+    if( low != level ) {
+        level = low;
+        changed = now;
+    }
+    else if( level != pressed && now - changed >= debounce ) {
+        pressed = level;
+        if( pressed ) {
             JbdBms::Status_t data = {0};
             jbdbms.getStatus(data);
-            data.mosfetStatus ^= JbdBms::MOSFET_CHARGE;
-            if (jbdbms.setMosfetStatus((JbdBms::mosfet_t)data.mosfetStatus)) {
+            JbdBms::mosfet_t status = (JbdBms::mosfet_t)((data.mosfetStatus ^ JbdBms::MOSFET_CHARGE) & JbdBms::MOSFET_BOTH);
+            if (scheduler.setMosfet(status, data)) {
                 if( data.mosfetStatus & JbdBms::MOSFET_CHARGE ) {
                     Serial.println("Charge mosfet switched ON");
                 }
@@ -514,44 +1250,50 @@ void handle_load_button( bool loadOn ) {
 }
 
 
-// check once every 500ms if load status has changed
-// return true if load is on (or unknown)
-bool handle_load_led() {
-    static uint32_t prevTime = 0;
-    static bool prevStatus = false;  // status unknown
-    static bool prevLoad = true;     // assume load is on
+// check if load status has changed (polled every 500ms)
+bool loadStatus = false;  // status unknown
+bool loadOn = true;       // assume load is on
 
-    uint32_t now = millis();
-    if( now - prevTime > 500 ) {
-        prevTime = now;
-        JbdBms::Status_t data = {0};
-        bool rc = jbdbms.getStatus(data);
-        bool loadOn = data.mosfetStatus & JbdBms::MOSFET_CHARGE;
-        if( rc ) {
-            if( !prevStatus || loadOn != prevLoad ) {
-                if( loadOn ) {
-                    digitalWrite(LOAD_LED_PIN, LOAD_LED_ON);
-                    Serial.println("Charge mosfet is ON");
-                }
-                else {
-                    digitalWrite(LOAD_LED_PIN, LOAD_LED_OFF);
-                    Serial.println("Charge mosfet is OFF");
-                }
-                prevStatus = true;
-                prevLoad = loadOn;
+void handle_load_led( JbdBms::cmd_t command, bool ok, const JbdScheduler::data_t &result ) {
+    bool on = result.status.mosfetStatus & JbdBms::MOSFET_CHARGE;
+    if( ok ) {
+        if( !loadStatus || on != loadOn ) {
+            if( on ) {
+                digitalWrite(LOAD_LED_PIN, LOAD_LED_ON);
+                Serial.println("Charge mosfet is ON");
             }
-        }
-        else {
-            if( prevStatus ) {
-                digitalWrite(LOAD_LED_PIN, LOAD_LED_ON);  // assume ON
-                Serial.println("Charge mosfet is UNKNOWN");
-                prevStatus = false;
-                prevLoad = true;
+            else {
+                digitalWrite(LOAD_LED_PIN, LOAD_LED_OFF);
+                Serial.println("Charge mosfet is OFF");
             }
+            loadStatus = true;
+            loadOn = on;
+        }
+    }
+    else {
+        if( loadStatus ) {
+            digitalWrite(LOAD_LED_PIN, LOAD_LED_ON);  // assume ON
+            Serial.println("Charge mosfet is UNKNOWN");
+            loadStatus = false;
+            loadOn = true;
         }
     }
+}
+
 
-    return prevLoad;
+// Share poll results with the subscribers of the bus
+void publish_poll( JbdBms::cmd_t command, bool ok, const JbdScheduler::data_t &data ) {
+    bus.publish(command, ok, data);
+}
+
+
+// Register device polls. One line per poll, the scheduler keeps them apart on the bus
+void setup_polls() {
+    scheduler.add(JbdBms::HARDWARE, 600000, 3, 0, publish_poll);
+    statusPoll = scheduler.add(JbdBms::STATUS, 10000, 2, 1000, publish_poll);
+    cellsPoll = scheduler.add(JbdBms::CELLS, 10000, 1, 1000, publish_poll);  // after status so we know the number of cells
+    scheduler.add(JbdBms::STATUS, 500, 0, 500, handle_load_led);  // led only, bus subscribers get the regular rate
+    setup_capture();  // lowest priority, uses the bus time the polls above leave
 }
 
 
@@ -571,7 +1313,7 @@ bool check_ntptime() {
         have_time = true;
         time_t now = time(NULL);
         strftime(start_time, sizeof(start_time), "%FT%T%Z", localtime(&now));
-        syslog.logf(LOG_NOTICE, "Got valid time at %s", start_time);
+        log_printf(LOG_NOTICE, "Got valid time at %s", start_time);
     }
 
     return have_time;
@@ -617,9 +1359,11 @@ void handle_breathe() {
 // Startup
 void setup() {
     WiFi.mode(WIFI_STA);
-    String host(HOSTNAME);
-    host.toLowerCase();
-    WiFi.hostname(host.c_str());
+    char host[] = HOSTNAME;
+    for (char *c = host; *c; c++) {
+        *c = tolower(*c);
+    }
+    WiFi.hostname(host);
 
     pinMode(HEALTH_LED_PIN, OUTPUT);
     digitalWrite(HEALTH_LED_PIN, HEALTH_LED_ON);
@@ -652,10 +1396,11 @@ void setup() {
 
     digitalWrite(HEALTH_LED_PIN, HEALTH_LED_ON);
     char msg[80];
-    snprintf(msg, sizeof(msg), "%s Version %s, WLAN IP is %s", PROGNAME, VERSION,
-        WiFi.localIP().toString().c_str());
+    IPAddress ip = WiFi.localIP();
+    snprintf(msg, sizeof(msg), "%s Version %s, WLAN IP is %u.%u.%u.%u", PROGNAME, VERSION,
+        ip[0], ip[1], ip[2], ip[3]);
     Serial.println(msg);
-    syslog.logf(LOG_NOTICE, msg);
+    syslog.log(LOG_NOTICE, msg);
 
     #if defined(ESP8266)
         ntp.begin();
@@ -665,6 +1410,8 @@ void setup() {
 
     MDNS.begin(WiFi.getHostname());
 
+    mqtt.setServer(MQTT_SERVER, MQTT_PORT);
+
     esp_updater.setup(&web_server);
     setup_webserver();
 
@@ -685,6 +1432,20 @@ void setup() {
     digitalWrite(LOAD_LED_PIN, LOAD_LED_OFF);
 
     jbdbms.begin(RS485_DIR_PIN);
+    setup_subscribers();
+    setup_polls();
+
+#if defined(ESP32)
+    bool have_fs = LittleFS.begin(true);  // format if mount fails
+#else
+    bool have_fs = LittleFS.begin();
+#endif
+    if (have_fs) {
+        spool.begin();
+    }
+    else {
+        syslog.log(LOG_ERR, "LittleFS mount failed, no influx spool");
+    }
 
     Serial.println("Setup done");
 }
@@ -693,15 +1454,18 @@ void setup() {
 // Main loop
 void loop() {
     // TODO set/reset err_interval for breathing
-    handle_jbdHardware();
     bool have_time = check_ntptime();
-    if( jbdHardware.id[0] ) {  // we have required infos
-        if (have_time && enabledBreathing) {
-            handle_breathe();
-        }
-        handle_jbdStatus();
-        handle_jbdCells();
+    if( bmsId()[0] && have_time && enabledBreathing ) {  // we have required infos
+        handle_breathe();
+    }
+    scheduler.handle();
+    handle_log();
+    if (INFLUX_WINDOW) {
+        aggregator.handle();
     }
-    handle_load_button(handle_load_led());
+    handle_load_button(loadOn);
+    handle_spool();
+    handle_mqtt();
     web_server.handleClient();
+    handle_memory();
 }
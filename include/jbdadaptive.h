@@ -0,0 +1,51 @@
+#ifndef JBDADAPTIVE
+#define JBDADAPTIVE
+
+/*
+Activity adaptive poll period for JbdBms samples
+
+Feed each decoded status and cells sample to update(). If current, voltage or cell spread
+changed by at least their threshold since the previous sample, the period is divided
+by 1 + activity (activity = largest change / threshold), down to min_ms.
+A change of mosfet status or fault bits jumps to min_ms immediately.
+Without activity the period grows by decay_percent per status sample up to max_ms.
+
+The returned period is meant for JbdScheduler::setPeriod() of the status and cells polls.
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+*/
+
+#include <Arduino.h>
+#include <jbdbms.h>
+
+class JbdAdaptiveRate {
+public:
+    JbdAdaptiveRate( uint32_t min_ms = 1000, uint32_t max_ms = 60000, uint8_t decay_percent = 25 );
+
+    // Changes between two samples that count as activity
+    // current in 10mA, voltage in 10mV, cell spread (max-min cell voltage) in mV
+    void setThresholds( uint16_t current, uint16_t voltage, uint16_t spread );
+
+    // Return new period in ms
+    uint32_t update( const JbdBms::Status_t &status );
+    uint32_t update( const JbdBms::Cells_t &cells, uint8_t count );
+
+    uint32_t period() const { return _period; }
+
+private:
+    uint32_t adapt( uint32_t activity_percent );
+    static uint32_t percent( int32_t prev, int32_t value, uint16_t threshold );
+
+    uint32_t _min, _max;
+    uint8_t _decay;
+    uint16_t _currentThreshold, _voltageThreshold, _spreadThreshold;
+    uint32_t _period;
+
+    bool _haveStatus, _haveCells;
+    int16_t _current;
+    uint16_t _voltage, _fault, _spread;
+    uint8_t _mosfetStatus;
+};
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef JBDAGGREGATOR
+#define JBDAGGREGATOR
+
+/*
+Windowed aggregation of JbdBms samples
+
+Keeps min, max, mean, last and count of each status value, temperature and cell voltage
+over a window of configurable length in constant memory. When a window is complete
+the handler is called with the aggregate and the next window starts.
+Use one object per window length and device (e.g. 1 min and 15 min).
+
+Windows are aligned to the start of the first one. Windows without samples are not reported.
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+*/
+
+#include <Arduino.h>
+#include <jbdbms.h>
+
+class JbdAggregator {
+public:
+    typedef struct field {
+        int32_t min, max, last;
+        int64_t sum;
+        uint32_t count;
+
+        int32_t mean() const { return count ? (int32_t)(sum / (int64_t)count) : 0; }
+    } field_t;
+
+    typedef struct aggregate {
+        uint32_t start;              // millis() of window start
+        uint32_t window;             // length in ms
+        field_t voltage;             // in 10 mV
+        field_t current;             // in 10 mA
+        field_t remainingCapacity;   // in 10 mAh
+        field_t currentCapacity;     // percentage
+        field_t temperatures[sizeof(JbdBms::Status_t::temperatures)/sizeof(JbdBms::temperature_t)];  // in 0.1 °C
+        field_t cells[sizeof(JbdBms::Cells_t::voltages)/sizeof(uint16_t)];  // in mV
+        uint16_t fault;              // all fault bits seen in the window
+        uint8_t ntcs;                // valid temperatures
+        uint8_t cellCount;           // valid cells
+    } aggregate_t;
+
+    typedef void (*handler_t)( const aggregate_t &aggregate );
+
+    JbdAggregator( uint32_t window_ms, handler_t handler );
+
+    // Add decoded samples. count is the number of valid cells (Status_t::cells)
+    void add( const JbdBms::Status_t &status );
+    void add( const JbdBms::Cells_t &cells, uint8_t count );
+
+    // Call regularly (e.g. from loop()) to report windows that ended without later samples
+    void handle();
+
+    // Append ",<name>_min=...,<name>_max=...,<name>_mean=...,<name>_last=..." (influx line protocol)
+    // Return number of chars appended or 0 if the fields do not fit into maxlen
+    static size_t influxFields( char *line, size_t maxlen, const char *name, const field_t &field );
+
+private:
+    void roll();
+    static void add( field_t &field, int32_t value );
+
+    handler_t _handler;
+    aggregate_t _aggregate;
+    uint32_t _samples;
+    bool _running;
+};
+
+#endif
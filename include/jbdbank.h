@@ -0,0 +1,107 @@
+#ifndef JBDBANK
+#define JBDBANK
+
+/*
+Virtual battery bank of 2 to 8 JbdBms packs in parallel
+
+The bank keeps the latest status and cell voltage summary of each pack and aggregates them
+into one view: mean voltage, summed current and capacities, bank wide min/max cell with
+pack and cell index, combined faults and the current imbalance between the packs.
+
+Samples are aligned in time: only packs with samples not older than max_age_ms relative
+to the newest sample are part of the aggregate, its time is the time of the newest sample
+and spread tells how far apart the contributing samples are.
+poll() reads all packs back to back, so their samples are as close as the bus allows.
+Alternatively feed samples polled elsewhere (e.g. by a JbdScheduler per pack) with update().
+
+Aggregation is incremental: an update subtracts the previous contribution of the pack from
+the sums and adds the new one, only min/max are rescanned over the (few) packs.
+Cell voltages are reduced to min/max per pack when they arrive.
+
+Example:
+    JbdBank bank;
+    bank.add(pack1);  // JbdBms objects on their own serial ports
+    bank.add(pack2);
+    ...
+    bank.poll();
+    const JbdBank::bank_t &b = bank.bank();
+    Serial.printf("%u packs, %d0 mA, imbalance %u0 mA\n", b.packs, b.current, b.imbalance);
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+*/
+
+#include <Arduino.h>
+#include <jbdbms.h>
+
+class JbdBank {
+public:
+    static const size_t MAX_PACKS = 8;
+
+    typedef struct pack {
+        uint32_t time;             // millis() of last status
+        bool valid;                // status received
+        JbdBms::Status_t status;   // latest status
+        uint16_t minCell, maxCell; // mV, 0 if no cells received
+        uint8_t minIndex, maxIndex;
+    } pack_t;
+
+    typedef struct bank {
+        uint32_t time;               // millis() of the newest sample
+        uint32_t spread;             // ms between oldest and newest contributing sample
+        uint8_t packs;               // contributing packs
+        uint8_t packMask;            // bit i is set if pack i contributes
+        uint16_t voltage;            // in 10 mV, mean of the pack voltages
+        int32_t current;             // in 10 mA, sum, positive means charge
+        uint32_t remainingCapacity;  // in 10 mAh, sum
+        uint32_t nominalCapacity;    // in 10 mAh, sum
+        uint8_t currentCapacity;     // percentage of summed capacities
+        uint16_t minCell, maxCell;   // mV, bank wide
+        uint8_t minCellPack, minCellIndex;  // pack and cell index of minCell
+        uint8_t maxCellPack, maxCellIndex;  // pack and cell index of maxCell
+        uint16_t fault;              // all fault bits of the packs
+        uint8_t faultMask;           // bit i is set if pack i has a fault
+        uint32_t imbalance;          // in 10 mA, max - min pack current
+    } bank_t;
+
+    // Packs older than max_age_ms relative to the newest are left out
+    JbdBank( uint32_t max_age_ms = 5000 );
+
+    // Add a device. Return its pack index or -1 if MAX_PACKS are already added
+    int add( JbdBms &bms );
+
+    // Read status and cells of all packs back to back. Return true if all succeeded
+    bool poll();
+
+    // Feed samples of pack index. Cells use the number of cells of the latest status
+    void update( size_t index, const JbdBms::Status_t &status );
+    void update( size_t index, const JbdBms::Cells_t &cells );
+
+    // A pack is no longer available (e.g. read failed)
+    void invalidate( size_t index );
+
+    // Aggregate over all packs with aligned samples
+    const bank_t &bank() const { return _bank; }
+
+    size_t packs() const { return _count; }
+    const pack_t &pack( size_t index ) const { return _packs[index]; }
+
+private:
+    void contribute( size_t index, int sign );
+    void expire();
+    void scan();
+
+    JbdBms *_bms[MAX_PACKS];
+    pack_t _packs[MAX_PACKS];
+    size_t _count;
+    uint32_t _maxAge;
+
+    // running sums of the contributing packs
+    uint32_t _voltageSum;
+    int32_t _currentSum;
+    uint32_t _remainingSum;
+    uint32_t _nominalSum;
+    bank_t _bank;
+};
+
+#endif
@@ -52,15 +52,16 @@ License: GPL V2
 #include <Arduino.h>
 #include <Stream.h>
 
-// Don't use padding in structures to match what jbd bms devices need
-#pragma pack(2)
-
-class JbdBms {
+// Transport and everything not depending on the number of cells and ntcs
+class JbdBmsBase {
 public:
     // Datatypes used by the device
 
     typedef enum direction { READ=0xa5, WRITE=0x5a } direction_t;
 
+    // Wire structures must not be padded to match what jbd bms devices send
+    #pragma pack(push, 2)
+
     typedef struct request_header {
         uint8_t start, direction, command, length;
     } request_header_t;
@@ -69,6 +70,16 @@ public:
         uint8_t start, command, returncode, length;
     } response_header_t;
 
+    typedef struct temperature {
+        uint8_t hi, lo;  // big endian uint16_t starting at odd address 
+    } temperature_t;
+
+    typedef struct Hardware {
+        char id[32];  // max 31 chars + EOS (not sent)
+    } Hardware_t;
+
+    #pragma pack(pop)
+
     // Enum values represent states of 2 bits
     typedef enum mosfet { MOSFET_NONE, MOSFET_CHARGE, MOSFET_DISCHARGE, MOSFET_BOTH } mosfet_t;
 
@@ -84,36 +95,7 @@ public:
         ERR = 0x80
     } returncode_t;
 
-    typedef struct temperature {
-        uint8_t hi, lo;  // big endian uint16_t starting at odd address 
-    } temperature_t;
-
-    typedef struct Status {
-        uint16_t voltage;            // in 10 mV
-        int16_t current;             // in 10 mA, positive means charge, negative discharge
-        uint16_t remainingCapacity;  // in 10 mAh last full capacity
-        uint16_t nominalCapacity;    // in 10 mAh 
-        uint16_t cycles;
-        uint16_t productionDate;     // |7 bits year since 2000|4 bit month 1..12|5bit day 1..31|
-        uint16_t balanceLow;         // bit is set if cell is balanced (cell 1..16)
-        uint16_t balanceHigh;        // bit is set if cell is balanced (cell 17..32)
-        uint16_t fault;              // bit is set if fault protection is active (see static protection functions)
-        uint8_t version;             // bms firmware version
-        uint8_t currentCapacity;     // percentage 
-        uint8_t mosfetStatus;        // see mosfet_t
-        uint8_t cells;
-        uint8_t ntcs;                // following this are the ntc temperatures in 0.1K, 2 bytes each
-        temperature_t temperatures[8];  // Jiabaida software uses 8 fields. Enough for my BMS type
-    } Status_t;
-
-    typedef struct Cells {
-        uint16_t voltages[32];  // max 32 cells supported
-    } Cells_t;
-
-    typedef struct Hardware {
-        char id[32];  // max 31 chars + EOS (not sent)
-    } Hardware_t;
-
+    static const size_t MAX_DATA = 64;  // longest data of a frame accepted (32 cells)
 
 
     // Basic methods
@@ -121,22 +103,31 @@ public:
     // Object represents device at serial port. Send commands with minimal delay given.
     // If prev is not NULL, JbdBms uses it to store millis() of last stream access and
     // expects other stream users to do the same (Joba_ESmart3 does the same)
-    JbdBms( Stream &serial, uint32_t *prev = NULL, uint8_t command_delay_ms = 60 );
+    JbdBmsBase( Stream &serial, uint32_t *prev = NULL, uint8_t command_delay_ms = 60 );
 
     // Init dir_pin. -1 if RS485 hardware sets direction automatically
     void begin( int dir_pin = -1 );
 
-    // Send header and command then receive header and result (not including crc)
+    // Send header and command then receive header and at most size bytes of result (not including crc)
     // Return true if header and command are written and result and header are read successfully
-    bool execute( request_header_t &header, uint8_t *command, uint8_t *result );
+    bool execute( request_header_t &header, uint8_t *command, uint8_t *result, size_t size = MAX_DATA );
+
+    // The two halves of execute(). Can be used to have more than one request in flight,
+    // e.g. with a TCP serial bridge (see jbdbmstcp.h). Responses must be received in request order.
+    // Return true if header and command are written
+    bool send( request_header_t &header, uint8_t *command );
+    // Return true if a valid response to command is read (unrelated frames in front of it are skipped).
+    // Data beyond size bytes is read and checked, but dropped
+    bool receive( uint8_t command, uint8_t *result, size_t size = MAX_DATA );
+
+    // If enabled, combined commands send the next request before the previous response is read.
+    // Only useful if the device is behind a bridge that queues requests (default: disabled)
+    void setPipelining( bool enable ) { _pipelining = enable; }
 
 
     // Commands. Return true if execute() was successful
 
-    bool getStatus( Status_t &data );
-    bool getCells( Cells_t &data );
     bool getHardware( Hardware_t &data );
-
     bool setMosfetStatus( mosfet_t status );
 
 
@@ -148,7 +139,10 @@ public:
     static uint16_t year( uint16_t prodDate ) { return (prodDate >> 9) + 2000; }
     static uint8_t month( uint16_t prodDate ) { return (prodDate >> 5) & 0xf; }
     static uint8_t day( uint16_t prodDate ) { return prodDate & 0x1f; }
-    static const char *balance( const Status_t &data );
+    static const char *balance( uint32_t balanceBits, uint8_t cells );
+
+    // Checksum of a frame from 3rd byte on, in device byte order (0 on error)
+    static uint16_t genCrc( uint8_t byte, uint8_t len, uint8_t *data );
 
     static bool isCellOvervoltage( uint16_t fault )           { return fault & 0x0001; }
     static bool isCellUndervoltage( uint16_t fault )          { return fault & 0x0002; }
@@ -164,12 +158,15 @@ public:
     static bool isIcError( uint16_t fault )                   { return fault & 0x0800; }
     static bool isMosfetSoftwareLock( uint16_t fault )        { return fault & 0x1000; }
 
+protected:
+    bool _pipelining;
+
 private:
     uint16_t genRequestCrc( request_header_t &header, uint8_t *data );
-    uint16_t genResponseCrc( response_header_t &header, uint8_t *data );
-    uint16_t genCrc( uint8_t byte, uint8_t len, uint8_t *data );
-    bool isValid( response_header_t &header, uint8_t *data, uint16_t crc );
     bool prepareCmd( request_header_t &header, uint8_t *command, uint16_t &crc );
+    bool readHeader( response_header_t &header );
+    bool readData( response_header_t &header, uint8_t *result, size_t size, uint16_t &crc );
+    bool skipFrame( response_header_t &header );
 
     Stream &_serial;
     uint8_t _delay;
@@ -178,4 +175,124 @@ private:
     int _dir_pin;
 };
 
+
+// Device with up to NCELLS cells and NNTCS temperature sensors.
+// Status and cells structures, decoding and balance strings are sized at compile time,
+// e.g. JbdBmsT<4, 2> for a 4S LiFePO pack needs 8 instead of 64 bytes per cells sample.
+// Cells and ntcs in Status_t are what the device reports, values beyond NCELLS or NNTCS are dropped.
+template<uint8_t NCELLS, uint8_t NNTCS>
+class JbdBmsT : public JbdBmsBase {
+public:
+    static_assert(NCELLS >= 1 && NCELLS <= 32, "1 to 32 cells supported");
+    static_assert(NNTCS >= 1 && NNTCS <= 16, "1 to 16 ntcs supported");
+
+    static const uint8_t MAX_CELLS = NCELLS;
+    static const uint8_t MAX_NTCS = NNTCS;
+
+    #pragma pack(push, 2)
+
+    typedef struct Status {
+        uint16_t voltage;            // in 10 mV
+        int16_t current;             // in 10 mA, positive means charge, negative discharge
+        uint16_t remainingCapacity;  // in 10 mAh last full capacity
+        uint16_t nominalCapacity;    // in 10 mAh 
+        uint16_t cycles;
+        uint16_t productionDate;     // |7 bits year since 2000|4 bit month 1..12|5bit day 1..31|
+        uint16_t balanceLow;         // bit is set if cell is balanced (cell 1..16)
+        uint16_t balanceHigh;        // bit is set if cell is balanced (cell 17..32)
+        uint16_t fault;              // bit is set if fault protection is active (see static protection functions)
+        uint8_t version;             // bms firmware version
+        uint8_t currentCapacity;     // percentage 
+        uint8_t mosfetStatus;        // see mosfet_t
+        uint8_t cells;
+        uint8_t ntcs;                // following this are the ntc temperatures in 0.1K, 2 bytes each
+        temperature_t temperatures[NNTCS];
+    } Status_t;
+
+    typedef struct Cells {
+        uint16_t voltages[NCELLS];
+    } Cells_t;
+
+    #pragma pack(pop)
+
+    JbdBmsT( Stream &serial, uint32_t *prev = NULL, uint8_t command_delay_ms = 60 )
+        : JbdBmsBase(serial, prev, command_delay_ms) {}
+
+
+    // Commands. Return true if execute() was successful
+
+    bool getStatus( Status_t &data ) {
+        request_header_t header = { 0, READ, STATUS, 0 };
+        bool rc = execute(header, 0, (uint8_t *)&data, sizeof(data));
+        decodeStatus(data);
+        return rc;
+    }
+
+    bool getCells( Cells_t &data ) {
+        request_header_t header = { 0, READ, CELLS, 0 };
+        bool rc = execute(header, 0, (uint8_t *)&data, sizeof(data));
+        decodeCells(data);
+        return rc;
+    }
+
+    // With pipelining the cells request waits at the bridge while the status response is transferred
+    bool getStatusAndCells( Status_t &status, Cells_t &cells ) {
+        if( !_pipelining ) {
+            bool rc = getStatus(status);
+            return getCells(cells) && rc;
+        }
+
+        request_header_t statusHeader = { 0, READ, STATUS, 0 };
+        request_header_t cellsHeader = { 0, READ, CELLS, 0 };
+        bool statusSent = send(statusHeader, 0);
+        bool cellsSent = statusSent && send(cellsHeader, 0);
+
+        bool rc = statusSent && receive(STATUS, (uint8_t *)&status, sizeof(status));
+        decodeStatus(status);
+        rc = cellsSent && receive(CELLS, (uint8_t *)&cells, sizeof(cells)) && rc;  // receive even if status failed
+        decodeCells(cells);
+        return rc;
+    }
+
+    using JbdBmsBase::setMosfetStatus;
+    // Set mosfets, then read status to confirm. Return true if data.mosfetStatus matches status
+    bool setMosfetStatus( mosfet_t status, Status_t &data ) {
+        return setMosfetStatus(status)
+            && getStatus(data)
+            && (data.mosfetStatus & MOSFET_BOTH) == status;
+    }
+
+
+    // Static helper functions
+
+    // Convert balance bits to string
+    // WARNING: not thread safe: returns shared buffer
+    static const char *balance( const Status_t &data ) {
+        uint8_t cells = data.cells < NCELLS ? data.cells : NCELLS;
+        return JbdBmsBase::balance((uint32_t)data.balanceHigh << 16 | data.balanceLow, cells);
+    }
+
+    // Swap device (big endian) values to host order and back
+    static void decodeStatus( Status_t &data ) {
+        swap(&data.voltage);
+        swap((uint16_t *)&data.current);
+        swap(&data.remainingCapacity);
+        swap(&data.nominalCapacity);
+        swap(&data.cycles);
+        swap(&data.productionDate);
+        swap(&data.balanceLow);
+        swap(&data.balanceHigh);
+        swap(&data.fault);
+    }
+
+    static void decodeCells( Cells_t &data ) {
+        for( uint8_t i = 0; i < NCELLS; i++ ) {
+            swap(&data.voltages[i]);
+        }
+    }
+};
+
+// Jiabaida software uses 8 temperature fields. Enough for my BMS type
+typedef JbdBmsT<32, 8> JbdBms;
+
 #endif
@@ -0,0 +1,58 @@
+#ifndef JBDBMSTCP
+#define JBDBMSTCP
+
+/*
+Stream to talk to a Jiabaida BMS behind a TCP to RS485 bridge (like ser2net)
+
+Use it as the stream of a JbdBms object. Raw frames are sent as they are, without any
+additional protocol. The connection is (re)established on demand, at most once per retry interval.
+
+Each request frame is collected and sent as one TCP segment on flush(), which JbdBms calls after writing.
+Unlike flush() of WiFiClient on ESP32 this never drops received data, so a second request
+can be sent while the response of the first one is still on its way (see JbdBms::setPipelining()).
+
+After a reconnect stale input is dropped and JbdBms resynchronizes on the next frame start byte.
+Responses to requests sent before the reconnect are lost and reported as errors by JbdBms.
+
+Example:
+    WiFiClient client;
+    JbdBmsTcp bridge(client, "rs485-bridge", 4001);
+    JbdBms jbdbms(bridge, NULL, 0);  // bridge does the RS485 timing
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+*/
+
+#include <Arduino.h>
+#include <Client.h>
+
+class JbdBmsTcp : public Stream {
+public:
+    // Object represents the bridge at host:port. Connect attempts are at least retry_ms apart
+    JbdBmsTcp( Client &client, const char *host, uint16_t port, uint32_t retry_ms = 5000 );
+
+    // Return true if connected (tries to connect if not)
+    bool connect();
+    void stop();
+    uint32_t connects() const { return _connects; }  // number of successful connects
+
+    // Stream interface
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t write( uint8_t byte ) override;
+    size_t write( const uint8_t *buffer, size_t size ) override;
+    void flush() override;  // send collected request frame
+
+private:
+    Client &_client;
+    const char *_host;
+    uint16_t _port;
+    uint32_t _retry_ms;
+    uint32_t _prev_connect;
+    uint32_t _connects;
+    uint8_t _frame[4 + 64 + 3];  // max request frame
+    size_t _len;
+};
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef JBDBUS
+#define JBDBUS
+
+/*
+Publish/subscribe bus for JbdBms samples
+
+Poll results are published once into a shared snapshot slot. Subscribers of a topic get a
+const reference to that snapshot, so adding a consumer (leds, web, influx, mqtt, display...)
+neither touches the polling code nor copies the sample.
+Subscribers can ask for changed samples only. Topic FAULT delivers the status snapshot
+whenever the fault bits changed. Failed polls are passed with ok=false and the last valid
+snapshot (check snapshot.time for its age).
+
+Snapshots are reference counted: latest() is valid until the next publish of its type.
+A consumer that needs a snapshot longer (e.g. while sending it in chunks) calls acquire() and
+release() when done. A held snapshot is never overwritten. If all slots of a type are held,
+publishing fails and is counted in overruns().
+
+Example:
+    JbdBus bus;
+    void publish_poll( JbdBms::cmd_t command, bool ok, const JbdScheduler::data_t &data ) {
+        bus.publish(command, ok, data);
+    }
+    void on_status( JbdBus::topic_t topic, bool ok, const JbdBus::snapshot_t &snapshot ) { ... }
+    ...
+    scheduler.add(JbdBms::STATUS, 10000, 2, 1000, publish_poll);
+    bus.subscribe(JbdBus::STATUS, on_status, true);
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+*/
+
+#include <Arduino.h>
+#include <jbdbms.h>
+#include <jbdscheduler.h>
+
+class JbdBus {
+public:
+    typedef enum topic { STATUS, CELLS, HARDWARE, FAULT } topic_t;
+
+    typedef struct snapshot {
+        uint32_t seq;   // publish counter of the bus, 0: no sample yet
+        uint32_t time;  // millis() of publish
+        union {
+            JbdBms::Status_t status;
+            JbdBms::Cells_t cells;
+            JbdBms::Hardware_t hardware;
+        };
+    } snapshot_t;
+
+    typedef void (*subscriber_t)( topic_t topic, bool ok, const snapshot_t &snapshot );
+
+    static const size_t MAX_SUBSCRIBERS = 12;
+    static const size_t SLOTS = 3;  // per data type: latest plus two held by consumers
+
+    JbdBus();
+
+    // Call subscriber for each sample of topic (only for changed ones if changes is true)
+    // Return id of the subscription or -1 if MAX_SUBSCRIBERS are already registered
+    int subscribe( topic_t topic, subscriber_t subscriber, bool changes = false );
+
+    // Store sample in a free slot and notify subscribers. Return false if no slot was free
+    bool publish( const JbdBms::Status_t &status );
+    bool publish( const JbdBms::Cells_t &cells );
+    bool publish( const JbdBms::Hardware_t &hardware );
+
+    // Notify subscribers of a failed read
+    void fail( topic_t topic );
+
+    // Publish result of a scheduler poll. Usable as body of a JbdScheduler handler
+    bool publish( JbdBms::cmd_t command, bool ok, const JbdScheduler::data_t &data );
+
+    // Latest snapshot of topic (FAULT: STATUS), seq 0 if none was published yet
+    const snapshot_t &latest( topic_t topic ) const { return _slots[type(topic)][_latest[type(topic)]]; }
+
+    // Keep the latest snapshot of topic until release()
+    const snapshot_t &acquire( topic_t topic );
+    void release( const snapshot_t &snapshot );
+
+    uint32_t overruns() const { return _overruns; }
+
+private:
+    static const size_t TYPES = 3;
+
+    typedef struct subscription {
+        topic_t topic;
+        subscriber_t subscriber;
+        bool changes;
+    } subscription_t;
+
+    static size_t type( topic_t topic ) { return topic == FAULT ? STATUS : topic; }
+
+    snapshot_t *slot( topic_t topic );
+    void commit( topic_t topic, snapshot_t *next, bool changed );
+    void notify( topic_t topic, bool ok, bool changed, const snapshot_t &snapshot );
+
+    snapshot_t _slots[TYPES][SLOTS];
+    uint8_t _refs[TYPES][SLOTS];
+    uint8_t _latest[TYPES];
+    subscription_t _subscriptions[MAX_SUBSCRIBERS];
+    size_t _count;
+    uint32_t _seq;
+    uint32_t _overruns;
+};
+
+#endif
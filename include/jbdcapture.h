@@ -0,0 +1,104 @@
+#ifndef JBDCAPTURE
+#define JBDCAPTURE
+
+/*
+Fault triggered burst capture of JbdBms samples, like an oscilloscope
+
+While armed, status and cell samples (polled as fast as the bus allows) go into a rolling
+pre-trigger ring buffer. A trigger freezes the samples before it, then the post-trigger
+window is recorded and the capture is frozen until it is armed again.
+
+Triggers:
+* rising fault bits (any bit in the fault mask, e.g. overcurrent or short circuit)
+* a cell voltage above or below a threshold
+* a current step between two status samples
+* trigger() from the application
+
+The ring buffer is supplied by the caller, so nothing is allocated at trigger time.
+Of size records, post are recorded after the trigger and up to size - post - 1 before it.
+
+Example:
+    JbdCapture::record_t records[200];
+    JbdCapture capture(records, 200, 50);
+    capture.setTriggers(0xffff, 3650, 2500, 2000);
+    capture.arm();
+    ...
+    capture.add(status);
+    capture.add(cells, status.cells);
+    if (capture.state() == JbdCapture::FROZEN) { download(); capture.arm(); }
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+*/
+
+#include <Arduino.h>
+#include <jbdbms.h>
+
+class JbdCapture {
+public:
+    typedef enum state { IDLE, ARMED, TRIGGERED, FROZEN } state_t;
+    typedef enum trigger { NONE, FAULT, CELL_HIGH, CELL_LOW, CURRENT_STEP, MANUAL } trigger_t;
+
+    typedef struct record {
+        uint32_t time;       // millis() of the sample
+        uint8_t command;     // JbdBms::STATUS or JbdBms::CELLS
+        uint8_t count;       // valid cells
+        union {
+            JbdBms::Status_t status;
+            JbdBms::Cells_t cells;
+        };
+    } record_t;
+
+    // Capture into size records of storage, post of them after the trigger
+    JbdCapture( record_t *storage, size_t size, size_t post );
+
+    // Trigger on rising fault bits in fault_mask, cells above high or below low mV
+    // and current changes of at least current_step (10 mA). 0 disables a trigger
+    void setTriggers( uint16_t fault_mask, uint16_t cell_high_mV = 0, uint16_t cell_low_mV = 0, uint16_t current_step = 0 );
+
+    // Clear the buffer and wait for a trigger
+    void arm();
+
+    // Trigger now (if armed)
+    void trigger() { fire(MANUAL); }
+
+    // Record samples. Return true if the sample was recorded
+    bool add( const JbdBms::Status_t &status );
+    bool add( const JbdBms::Cells_t &cells, uint8_t count );
+
+    state_t state() const { return _state; }
+    trigger_t reason() const { return _reason; }
+    uint32_t triggerTime() const { return _triggerTime; }
+
+    // Recorded samples, oldest first. triggerIndex() is the record that fired the trigger,
+    // records() if there is none
+    size_t records() const { return _count; }
+    const record_t &record( size_t index ) const { return _storage[(_head + _size - _count + index) % _size]; }
+    size_t triggerIndex() const;
+
+    static const char *stateName( state_t state );
+    static const char *reasonName( trigger_t reason );
+
+private:
+    record_t &push( uint8_t command );
+    void fire( trigger_t reason );
+    void recorded();
+
+    record_t *_storage;
+    size_t _size;
+    size_t _post;
+    size_t _head;
+    size_t _count;
+    size_t _postLeft;
+
+    uint16_t _faultMask, _cellHigh, _cellLow, _currentStep;
+
+    state_t _state;
+    trigger_t _reason;
+    uint32_t _triggerTime;
+    bool _haveStatus;
+    uint16_t _fault;
+    int16_t _current;
+};
+
+#endif
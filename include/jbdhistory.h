@@ -0,0 +1,106 @@
+#ifndef JBDHISTORY
+#define JBDHISTORY
+
+/*
+On-device history of JbdBms samples
+
+Keeps one compact sample (20 bytes) per interval in a ring buffer supplied by the caller, e.g.
+1440 samples for 24 h at 60 s (29 kB). Status and cells of an interval are merged: status
+values are the last ones, cell voltages the lowest min and highest max cell of the interval.
+
+Samples are stored in time order, so the ring itself is the time index: a query finds its
+first sample with a binary search and then downsamples on the fly, one point per step.
+Points are returned one at a time, so a large range can be streamed in small chunks.
+Samples become visible when their interval is complete. A clock step backwards clears the history.
+An interval without a status sample (e.g. a failed status poll) keeps its cells, but does not
+count for the status means.
+
+Example:
+    JbdHistory::sample_t samples[1440];
+    JbdHistory history(samples, 1440, 60);
+    ...
+    history.add(time(NULL), status);
+    history.add(time(NULL), cells, status.cells);
+    ...
+    JbdHistory::query_t query;
+    JbdHistory::point_t point;
+    history.begin(query, from, to, 600);
+    while (history.next(query, point)) { print(point); }
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+*/
+
+#include <Arduino.h>
+#include <jbdbms.h>
+
+class JbdHistory {
+public:
+    typedef struct sample {
+        uint32_t time;              // unix time of the interval start
+        uint16_t voltage;           // in 10 mV
+        int16_t current;            // in 10 mA
+        uint16_t remainingCapacity; // in 10 mAh
+        uint16_t fault;             // all fault bits of the interval
+        uint16_t minCell, maxCell;  // mV, 0 if no cells
+        int16_t temperature;        // in 0.1 °C, first ntc
+        uint8_t currentCapacity;    // percentage
+        uint8_t mosfetStatus : 2;
+        uint8_t hasStatus : 1;      // status values are valid (else the interval only got cells)
+    } sample_t;
+
+    // Downsampled samples of one step. Status values are from samples with status only (0 if none)
+    typedef struct point {
+        uint32_t time;              // start of the step
+        uint16_t count;             // samples in the step
+        uint16_t voltage;           // mean
+        int16_t current;            // mean
+        int16_t temperature;        // mean
+        uint16_t remainingCapacity; // last
+        uint8_t currentCapacity;    // last
+        uint8_t mosfetStatus;       // last
+        uint16_t fault;             // all bits
+        uint16_t minCell, maxCell;  // lowest and highest
+    } point_t;
+
+    typedef struct query {
+        uint32_t from, to, step;
+        size_t pos;                 // next sample
+    } query_t;
+
+    // Store one sample per interval_s seconds in storage
+    JbdHistory( sample_t *storage, size_t size, uint32_t interval_s = 60 );
+
+    // Add decoded samples at unix time now. count is the number of valid cells
+    void add( uint32_t now, const JbdBms::Status_t &status );
+    void add( uint32_t now, const JbdBms::Cells_t &cells, uint8_t count );
+
+    // Prepare a query of [from, to] in steps of step seconds (0: interval).
+    // Return false if there are no samples in the range
+    bool begin( query_t &query, uint32_t from, uint32_t to, uint32_t step = 0 );
+
+    // Get next point of the query. Return false if there is none
+    bool next( query_t &query, point_t &point ) const;
+
+    size_t count() const { return _count; }
+    size_t size() const { return _size; }
+    uint32_t interval() const { return _interval; }
+    uint32_t first() const { return _count ? at(0).time : 0; }  // time of oldest sample
+    uint32_t last() const { return _count ? at(_count - 1).time : 0; }  // time of newest stored sample
+
+private:
+    bool slot( uint32_t now );
+    void push();
+    const sample_t &at( size_t index ) const { return _storage[(_head + _size - _count + index) % _size]; }
+    size_t lowerBound( uint32_t time ) const;
+
+    sample_t *_storage;
+    size_t _size;
+    size_t _head;      // next write position
+    size_t _count;
+    uint32_t _interval;
+    sample_t _pending; // sample of the current interval
+    bool _havePending;
+};
+
+#endif
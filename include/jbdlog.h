@@ -0,0 +1,106 @@
+#ifndef JBDLOG
+#define JBDLOG
+
+/*
+Deferred binary logging
+
+log() only stores a format id, priority, millis() and the raw integer arguments in a ring
+buffer supplied by the caller. Formatting is done later, when there is time (e.g. a few
+entries per loop() iteration), either on the device with format() or on a PC:
+encode() packs entries as hex, e.g. for a syslog message, and tools/jbdlog.py decodes them
+with the same format strings.
+
+Formats are printf strings with integer conversions only (d, i, u, x, X, o, c and %%),
+every argument is stored as 32 bit. If an entry has more arguments than its format has
+conversions (see logArray()), the last conversion is repeated for the rest, separated by ','.
+
+Entry layout: length of the rest, id, priority, argument count, then millis() and
+the arguments as unsigned LEB128 varints. Small values like cell voltages take 2 bytes.
+If the ring is full the oldest entries are dropped.
+
+Formats are usually defined once in a header that tools/jbdlog.py can read, like this:
+    // logformats.h
+    JBDLOG_FORMAT(STATUS, "status voltage=%u current=%d")
+    JBDLOG_FORMAT(CELLS, "cells mV=%u")
+
+    #define JBDLOG_FORMAT(name, fmt) LOG_##name,
+    enum {
+    #include "logformats.h"
+    };
+    #undef JBDLOG_FORMAT
+    #define JBDLOG_FORMAT(name, fmt) fmt,
+    const char *const formats[] = {
+    #include "logformats.h"
+    };
+
+Example:
+    uint8_t ring[2048];
+    JbdLog jbdlog(ring, sizeof(ring), formats, sizeof(formats)/sizeof(*formats));
+    ...
+    jbdlog.log(LOG_STATUS, LOG_INFO, status.voltage, status.current);
+    jbdlog.logArray(LOG_CELLS, LOG_INFO, cells.voltages, status.cells);
+    ...
+    uint8_t priority;
+    if (idle && jbdlog.format(line, sizeof(line), priority)) syslog.log(priority, line);
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+*/
+
+#include <Arduino.h>
+
+class JbdLog {
+public:
+    static const uint8_t MAX_FORMATS = 32;
+    static const uint8_t MAX_ARGS = 40;
+    static const size_t MAX_ENTRY = 4 + 5 + 5 * MAX_ARGS;  // bytes
+
+    // Keep entries in size bytes of storage. Formats must stay valid (usually string literals)
+    JbdLog( uint8_t *storage, size_t size, const char *const *formats, uint8_t count );
+
+    // Record entry of format id with as many integer arguments as the format has conversions.
+    // Return false if id is unknown or the entry does not fit into the ring
+    bool log( uint8_t id, uint8_t priority, ... );
+
+    // Record entry of format id with count arguments or values
+    bool logArgs( uint8_t id, uint8_t priority, const uint32_t *args, uint8_t count );
+    bool logArray( uint8_t id, uint8_t priority, const uint16_t *values, uint8_t count );
+
+    // Format the oldest entry as text into buffer and remove it.
+    // Return false if there is none. Text longer than size is cut
+    bool format( char *buffer, size_t size, uint8_t &priority );
+
+    // Move as many complete entries as fit into buffer as hex string (an entry has at most
+    // MAX_ENTRY bytes, i.e. 2 * MAX_ENTRY + 1 chars). priority is the most severe (lowest) one.
+    // Return number of chars (0 if none)
+    size_t encode( char *buffer, size_t size, uint8_t &priority );
+
+    bool empty() const { return !_used; }
+    size_t used() const { return _used; }
+    size_t size() const { return _size; }
+    uint32_t logged() const { return _logged; }
+    uint32_t dropped() const { return _dropped; }  // oldest entries overwritten or entries too large
+
+    // Number of conversions in format (%% does not count)
+    static uint8_t conversions( const char *format );
+
+private:
+    bool record( uint8_t id, uint8_t priority, uint8_t argc, const uint32_t *args );
+    void put( uint8_t byte );
+    uint8_t peek( size_t offset ) const { return _storage[(_tail + offset) % _size]; }
+    uint32_t varint( size_t &offset ) const;
+    void drop();
+
+    uint8_t *_storage;
+    size_t _size;
+    size_t _head;  // next write position
+    size_t _tail;  // oldest entry
+    size_t _used;
+    const char *const *_formats;
+    uint8_t _count;
+    uint8_t _argc[MAX_FORMATS];
+    uint32_t _logged;
+    uint32_t _dropped;
+};
+
+#endif
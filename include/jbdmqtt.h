@@ -0,0 +1,115 @@
+#ifndef JBDMQTT
+#define JBDMQTT
+
+/*
+MQTT output of JbdBms samples with one retained topic per value
+
+Topics are <prefix>/status/<field>, <prefix>/status/temperature<n> and <prefix>/cells/<n>
+(n starts at 1). Payloads are plain numbers: volts, amperes, ampere hours, °C and
+cell volts with their decimals, everything else unsigned integers.
+
+A value is only published if it differs from the last published value by more than
+the deadband of its field. A topic is published at most once per interval. A change
+that comes too early stays pending and goes out with a later flush(), so the broker
+always ends up with the latest value, but a fluctuating current cannot flood it.
+
+add() only updates the values. flush() publishes all pending topics in one go, so the
+publisher can send them in as few network packets as possible. Publishing is done by a
+callback, so any client library (e.g. PubSubClient) or a test stand-in (see Bench example) can be used.
+
+Example:
+    bool publish( const char *topic, const char *payload, bool retained ) {
+        return mqtt.publish(topic, payload, retained);
+    }
+    JbdMqtt jbdmqtt("bms/1", publish);
+    jbdmqtt.setDeadband(JbdMqtt::CURRENT, 20);  // 200 mA
+    ...
+    jbdmqtt.add(status);
+    jbdmqtt.add(cells, status.cells);
+    jbdmqtt.flush();  // after each sample and now and then for rate limited values
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+*/
+
+#include <Arduino.h>
+#include <jbdbms.h>
+
+class JbdMqtt {
+public:
+    // Return true if topic was published
+    typedef bool (*publish_t)( const char *topic, const char *payload, bool retained );
+
+    typedef enum field {
+        VOLTAGE,             // V, deadband in 10 mV
+        CURRENT,             // A, deadband in 10 mA
+        REMAINING_CAPACITY,  // Ah, deadband in 10 mAh
+        NOMINAL_CAPACITY,
+        CYCLES,
+        BALANCE,             // bit 0 is cell 1
+        FAULT,
+        CURRENT_CAPACITY,    // %
+        MOSFET_STATUS,
+        CELLS,
+        NTCS,
+        TEMPERATURE,         // °C of first ntc, deadband in 0.1 °C
+        CELL = TEMPERATURE + 8  // V of first cell, deadband in mV
+    } field_t;
+
+    static const size_t MAX_FIELDS = CELL + 32;
+    static const size_t MAX_TOPIC = 96;
+
+    // Topics start with prefix (must stay valid). Each topic is published at most every interval_ms
+    JbdMqtt( const char *prefix, publish_t publish, uint32_t interval_ms = 10000 );
+
+    // Minimum change to publish a value (in device units, see field_t).
+    // TEMPERATURE and CELL set it for all temperatures or cells
+    void setDeadband( field_t field, uint16_t deadband );
+
+    // Minimum time between publications of a topic. TEMPERATURE and CELL set it for all
+    void setInterval( field_t field, uint32_t interval_ms );
+
+    // Update values from decoded samples. count is the number of valid cells
+    void add( const JbdBms::Status_t &status );
+    void add( const JbdBms::Cells_t &cells, uint8_t count );
+
+    // Publish pending topics that are not rate limited. Stops at the first failed publish.
+    // Return number of published topics
+    size_t flush();
+
+    // Publish all known values again with the next flush (e.g. after a reconnect)
+    void invalidate();
+
+    size_t pending() const { return _pending; }
+    uint32_t published() const { return _published; }
+    uint32_t suppressed() const { return _suppressed; }  // changes within the deadband
+    uint32_t limited() const { return _limited; }        // flushes that had to delay a topic
+    uint32_t failures() const { return _failures; }
+
+private:
+    typedef struct value {
+        int32_t current;        // latest sample
+        int32_t published;      // last published
+        uint32_t time;          // millis() of last publication
+        uint32_t interval;
+        uint16_t deadband;
+        bool known;             // current is valid
+        bool pending;           // current needs publishing
+        bool sent;              // published is valid
+    } value_t;
+
+    void update( size_t index, int32_t value );
+    void topic( char *buffer, size_t index ) const;
+    void payload( char *buffer, size_t size, size_t index ) const;
+
+    const char *_prefix;
+    publish_t _publish;
+    value_t _values[MAX_FIELDS];
+    size_t _pending;
+    uint32_t _published;
+    uint32_t _suppressed;
+    uint32_t _limited;
+    uint32_t _failures;
+};
+
+#endif
@@ -0,0 +1,61 @@
+#ifndef JBDPOOL
+#define JBDPOOL
+
+/*
+Fixed pool of equal sized output buffers
+
+Buffers are carved from an arena supplied by the caller (usually a static array), so the
+pool never uses the heap. Each buffer is owned by the consumer that acquired it (e.g. "influx",
+"syslog", "web") until it is released. Owners, current use and the high-water mark can be
+reported to find out how many buffers an application really needs.
+
+Example:
+    char arena[4 * 768];
+    JbdPool pool(arena, sizeof(arena), 768);
+    ...
+    char *line = pool.acquire("influx");
+    if (line) {
+        snprintf(line, pool.bufferSize(), ...);
+        post(line);
+        pool.release(line);
+    }
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+*/
+
+#include <Arduino.h>
+
+class JbdPool {
+public:
+    static const size_t MAX_BUFFERS = 16;
+
+    // Use arena for arena_size / buffer_size buffers (at most MAX_BUFFERS)
+    JbdPool( char *arena, size_t arena_size, size_t buffer_size );
+
+    // Return a free buffer now owned by owner (a string literal) or 0 if all are in use
+    char *acquire( const char *owner );
+
+    // Give an acquired buffer back. Unknown pointers are ignored
+    void release( const char *buffer );
+
+    size_t bufferSize() const { return _size; }
+    size_t buffers() const { return _count; }
+    size_t used() const { return _used; }
+    size_t highWater() const { return _highWater; }  // max buffers in use at the same time
+    uint32_t failures() const { return _failures; }  // acquire() calls without free buffer
+
+    // Owner of buffer index or 0 if it is free
+    const char *owner( size_t index ) const { return index < _count ? _owners[index] : 0; }
+
+private:
+    char *_arena;
+    size_t _size;
+    size_t _count;
+    const char *_owners[MAX_BUFFERS];
+    size_t _used;
+    size_t _highWater;
+    uint32_t _failures;
+};
+
+#endif
@@ -0,0 +1,125 @@
+#ifndef JBDSCHEDULER
+#define JBDSCHEDULER
+
+/*
+Poll scheduler for JbdBms read commands
+
+Register each poll with its command, period, priority, deadline and a handler for the result.
+handle() executes at most one due poll per call, so polls never overlap on the bus and
+the main loop stays responsive. If several polls are due, the one with highest priority
+(then the one due first) is executed. Polls are spread over the bus timeline: each poll
+starts one slot after the previously added one and keeps its phase by advancing its due
+time by its period (not by the time it actually ran).
+
+Per poll statistics count runs, errors, deadline misses and start jitter (start - due time).
+
+Mosfet commands take precedence over polls: setMosfet() switches immediately (call it from
+loop() context, e.g. a web handler, never while handle() is running) and requestMosfet() queues
+the command for the next handle() call, before any due poll. Both confirm the switch with a status
+read, which is also passed to the handlers of status polls. Command to confirmation latency is
+kept in mosfetStats(). Worst case latency of requestMosfet() is the rest of a running poll plus
+the write and the status read, about three transaction times.
+
+Example:
+    JbdScheduler scheduler(jbdbms);
+    scheduler.add(JbdBms::STATUS, 1000, 2, 500, on_status);
+    scheduler.add(JbdBms::CELLS, 5000, 1, 2000, on_cells);
+    scheduler.add(JbdBms::HARDWARE, 600000, 0, 0, on_hardware);
+    ...
+    void loop() { scheduler.handle(); }
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+*/
+
+#include <Arduino.h>
+#include <jbdbms.h>
+
+class JbdScheduler {
+public:
+    // Result buffer of a poll, member depends on command
+    typedef union data {
+        JbdBms::Status_t status;
+        JbdBms::Cells_t cells;
+        JbdBms::Hardware_t hardware;
+    } data_t;
+
+    // Called after each poll, ok is result of the JbdBms get-command
+    typedef void (*handler_t)( JbdBms::cmd_t command, bool ok, const data_t &data );
+
+    // Called after a requested mosfet command is confirmed (ok) or failed
+    typedef void (*mosfet_handler_t)( JbdBms::mosfet_t status, bool ok, uint32_t latency_ms, const JbdBms::Status_t &data );
+
+    typedef struct stats {
+        uint32_t runs;       // executed polls
+        uint32_t errors;     // polls that failed
+        uint32_t misses;     // polls started after their deadline or skipped
+        uint32_t maxJitter;  // ms max delay of start after due time
+        uint32_t sumJitter;  // ms sum of start delays (average: sumJitter/runs)
+    } stats_t;
+
+    typedef struct mosfet_stats {
+        uint32_t runs;         // executed mosfet commands
+        uint32_t errors;       // commands that failed or were not confirmed
+        uint32_t lastLatency;  // ms from command to confirmation (or failure)
+        uint32_t maxLatency;   // of confirmed commands
+    } mosfet_stats_t;
+
+    static const size_t MAX_POLLS = 8;
+
+    // Schedule polls of device bms. slot_ms is the bus time reserved for one poll
+    JbdScheduler( JbdBms &bms, uint16_t slot_ms = 150 );
+
+    // Poll command every period_ms. Higher priority wins if polls are due at the same time.
+    // Deadline is the allowed start delay after due time (0: period)
+    // Return id of the poll or -1 if MAX_POLLS are already registered or command is not a read
+    int add( JbdBms::cmd_t command, uint32_t period_ms, uint8_t priority, uint32_t deadline_ms, handler_t handler );
+
+    // Change period of a poll. The next run is at most period_ms from now (or now, if restart is true)
+    void setPeriod( int id, uint32_t period_ms, bool restart = false );
+    uint32_t getPeriod( int id ) const;
+
+    // Call from loop(). Execute a requested mosfet command or at most one due poll
+    // Return true if the bus was used
+    bool handle();
+
+    // Switch mosfets now and confirm with a status read. Return true if confirmed
+    bool setMosfet( JbdBms::mosfet_t status, JbdBms::Status_t &data );
+
+    // Switch mosfets with the next handle() call. A pending request is replaced
+    void requestMosfet( JbdBms::mosfet_t status, mosfet_handler_t handler = 0 );
+    const mosfet_stats_t &mosfetStats() const { return _mosfetStats; }
+
+    size_t polls() const { return _count; }
+    JbdBms::cmd_t command( int id ) const { return _polls[id].command; }
+    const stats_t &stats( int id ) const { return _polls[id].stats; }
+    void resetStats();
+
+private:
+    typedef struct poll {
+        JbdBms::cmd_t command;
+        uint32_t period;
+        uint32_t deadline;
+        uint32_t due;
+        uint8_t priority;
+        handler_t handler;
+        stats_t stats;
+    } poll_t;
+
+    bool run( JbdBms::cmd_t command );
+    bool confirmMosfet( JbdBms::mosfet_t status, uint32_t since, JbdBms::Status_t &data );
+
+    JbdBms &_bms;
+    uint16_t _slot;
+    poll_t _polls[MAX_POLLS];
+    size_t _count;
+    data_t _data;
+
+    volatile bool _mosfetPending;
+    JbdBms::mosfet_t _mosfetRequest;
+    uint32_t _mosfetSince;
+    mosfet_handler_t _mosfetHandler;
+    mosfet_stats_t _mosfetStats;
+};
+
+#endif
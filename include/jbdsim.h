@@ -0,0 +1,57 @@
+#ifndef JBDSIM
+#define JBDSIM
+
+/*
+Simulated Jiabaida BMS as a stream, for tests and benchmarks without a device
+
+Use it as the stream of a JbdBms object. Complete request frames written to it are answered
+with response frames built from the public status, cells and hardware members (host byte order).
+A mosfet write command changes status.mosfetStatus.
+
+With baud > 0 the bytes of a response become readable one by one at the speed of a serial line
+(10 bits per byte), starting response_us after the request, so transaction latencies are realistic.
+With baud 0 responses are readable immediately (in-memory loopback).
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+*/
+
+#include <Arduino.h>
+#include <jbdbms.h>
+
+class JbdBmsSim : public Stream {
+public:
+    JbdBmsSim( uint8_t cells = 4, uint8_t ntcs = 2, uint32_t baud = 0, uint32_t response_us = 2000 );
+
+    // Answers of the simulated device
+    JbdBms::Status_t status;
+    JbdBms::Cells_t cells;
+    JbdBms::Hardware_t hardware;
+
+    uint32_t requests() const { return _requests; }  // number of answered requests
+
+    // Stream interface
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t write( uint8_t byte ) override;
+    void flush() override {}
+    using Print::write;
+
+private:
+    void respond();
+
+    uint32_t _baud;
+    uint32_t _response_us;
+    uint32_t _requests;
+
+    uint8_t _request[4 + 64 + 3];
+    size_t _requestLen;
+
+    uint8_t _response[4 + 64 + 3];
+    size_t _responseLen;
+    size_t _responsePos;
+    uint32_t _responseStart;  // micros() of first response byte
+};
+
+#endif
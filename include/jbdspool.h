@@ -0,0 +1,79 @@
+#ifndef JBDSPOOL
+#define JBDSPOOL
+
+/*
+Persistent append-only spool for telemetry records (e.g. influx lines) during uplink outages
+
+Records are appended to segment files on a flash filesystem (LittleFS on ESP8266 and ESP32).
+Segment files are never rewritten, only appended to and removed as a whole, which keeps flash wear low.
+If all segments are full, the oldest one is removed (oldest first eviction), so the spool
+never uses more than segments * segment_size bytes.
+
+Draining is batched: batch() copies the oldest records into a buffer and commit() drops them
+after they have been delivered. batch() returns records at most every drain interval ms,
+so a returning uplink is not flooded. A record is only delivered if it fits into the batch
+buffer with its separator, so the maximum record size is the batch buffer size - 1.
+Longer and incomplete records are dropped when they are next in line, so they cannot block
+the records after them (see dropped()). The read position is kept in RAM only:
+after a restart the oldest segment is delivered again (at least once delivery).
+
+Segment file layout: uint32_t sequence number, then records of uint16_t length + data
+Appending after a restart or a failed write starts a new segment, so an incomplete
+record can only be at the end of a segment.
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+*/
+
+#include <Arduino.h>
+#include <FS.h>
+
+class JbdSpool {
+public:
+    // Segment files are named <path><n>.log with n < segments
+    JbdSpool( fs::FS &fs, const char *path = "/jbdspool", uint8_t segments = 8, 
+              uint32_t segment_size = 16384, uint32_t drain_interval_ms = 5000 );
+
+    // Find segments of a previous run. Call after the filesystem is mounted
+    void begin();
+
+    // Return true if record was appended
+    bool append( const void *data, uint16_t len );
+
+    // Copy as many of the oldest records as fit, each followed by separator. Records longer than maxlen - 1 are dropped
+    // Return bytes copied or 0 if spool is empty, only dropped records were found or drain interval not yet over
+    size_t batch( uint8_t *buffer, size_t maxlen, char separator = '\n' );
+
+    // Drop the records of the last batch
+    void commit();
+
+    bool empty() const { return _tail > _head; }
+    uint32_t segments() const { return empty() ? 0 : _head - _tail + 1; }
+    uint32_t evicted() const { return _evicted; }  // segments dropped because the spool was full
+    uint32_t dropped() const { return _dropped; }  // records dropped because they were too long or incomplete
+
+private:
+    const char *name( uint32_t seq );
+    void advance( uint32_t bytes, uint32_t size );
+    bool rotate();
+
+    fs::FS &_fs;
+    const char *_path;
+    uint8_t _segments;
+    uint32_t _segment_size;
+    uint32_t _interval;
+    uint32_t _prev_batch;
+
+    uint32_t _head;    // sequence number of segment for appending
+    uint32_t _tail;    // sequence number of segment for reading (empty if > _head)
+    uint32_t _size;    // bytes in head segment
+    uint32_t _offset;  // read position in tail segment
+    uint32_t _batch;   // bytes of the tail segment in the last batch
+    uint32_t _evicted;
+    uint32_t _dropped;
+    bool _rotate;      // start a new head segment with next append
+
+    char _name[32];
+};
+
+#endif
@@ -0,0 +1,77 @@
+#ifndef JBDTELEMETRY
+#define JBDTELEMETRY
+
+/*
+Compact binary frames of JbdBms samples for low bandwidth uplinks (LoRa, metered cellular)
+
+A frame holds status and/or cell voltages of one sample. It does not depend on earlier
+frames, so a lost frame costs nothing but its own sample. A 16 cell sample with status
+and 2 temperatures needs about 30 bytes instead of several hundred bytes of json.
+tools/jbdtelemetry.py decodes frames to json on a PC.
+
+Frame version 1 (varint: unsigned LEB128, zigzag: signed value as varint, 0,-1,1,-2... -> 0,1,2,3...):
+    u8      version (1)
+    u8      flags: bit 0-1 mosfetStatus, bit 2 fault, bit 3 balance, bit 4 status, bit 5 cells, bit 6 details
+  if status:
+    varint  voltage (10 mV)
+    zigzag  current (10 mA)
+    varint  remainingCapacity (10 mAh)
+    u8      currentCapacity (%)
+    u8      cells
+    u8      ntcs (number of temperatures that follow)
+    zigzag  first temperature (0.1 °C), then each following as difference to the previous one
+    if details: varint nominalCapacity, varint cycles, varint productionDate, u8 version
+    if fault: varint fault bits
+    if balance: (cells + 7) / 8 bytes of balance bits, bit 0 of the first byte is cell 1
+  if cells:
+    u8      count
+    varint  minimum cell voltage (mV)
+    u8      bits per cell offset (0-16)
+    count offsets from the minimum (mV), bit packed lsb first, padded to full bytes
+
+Fields not in the frame decode as 0. Unknown versions are rejected, so newer formats need a new version.
+
+Example:
+    uint8_t frame[JbdTelemetry::MAX_FRAME];
+    size_t len = JbdTelemetry::encode(frame, sizeof(frame), &status, &cells, status.cells);
+    lora.send(frame, len);
+    ...
+    uint8_t contents;
+    JbdTelemetry::decode(frame, len, status, cells, contents);
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+*/
+
+#include <Arduino.h>
+#include <jbdbms.h>
+
+class JbdTelemetry {
+public:
+    static const uint8_t VERSION = 1;
+    static const size_t MAX_FRAME = 128;  // 32 cells, 8 temperatures, all details
+
+    // Bits of flags byte (and contents of decode())
+    typedef enum flag {
+        MOSFET_MASK = 0x03,
+        FAULT = 0x04,
+        BALANCE = 0x08,
+        STATUS = 0x10,
+        CELLS = 0x20,
+        DETAILS = 0x40
+    } flag_t;
+
+    // Encode status and/or count cells (either may be 0) into buffer.
+    // details adds values that rarely change (nominal capacity, cycles, production date, firmware version)
+    // Return length of the frame or 0 if buffer is too small
+    static size_t encode( uint8_t *buffer, size_t size, const JbdBms::Status_t *status,
+        const JbdBms::Cells_t *cells, uint8_t count, bool details = false );
+
+    // Decode frame into status and cells, contents are the flags of the frame.
+    // Cells count is in status.cells (if the frame has no status, it is set from the cells).
+    // Return false if the version is unknown or the frame is truncated
+    static bool decode( const uint8_t *frame, size_t len, JbdBms::Status_t &status,
+        JbdBms::Cells_t &cells, uint8_t &contents );
+};
+
+#endif
@@ -0,0 +1,71 @@
+#ifndef JBDTRACE
+#define JBDTRACE
+
+/*
+Optional timing trace of JbdBms transactions
+
+Build with -DJBDBMS_TRACE to record a micros() timestamp at the end of each phase of a transaction
+into a fixed ring buffer. Without the define the trace points compile to nothing.
+
+Phases (each event marks the end of the phase, the phase starts with the previous event):
+BEGIN       send() called
+GAP         waiting for the command delay after the previous bus access
+WRITE       writing the request to the stream
+DRAIN       flush() until the request is on the wire
+TURNAROUND  switching the RS485 direction pin back to read
+FIRST_BYTE  waiting for the first response byte
+RECEIVE     reading the rest of the response
+CHECK       checksum and return code validation
+
+JbdTrace::dump() prints the buffer as "jbdtrace,<micros>,<phase>,<command>" lines.
+tools/jbdtrace2chrome.py converts such lines (e.g. from a serial log) into a
+Chrome/Perfetto trace json file.
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+*/
+
+#ifdef JBDBMS_TRACE
+
+#include <Arduino.h>
+
+#ifndef JBDBMS_TRACE_SIZE
+#define JBDBMS_TRACE_SIZE 256  // number of events in the ring buffer
+#endif
+
+#define JBD_TRACE(phase, command) JbdTrace::record(JbdTrace::phase, command)
+
+class JbdTrace {
+public:
+    typedef enum phase { BEGIN, GAP, WRITE, DRAIN, TURNAROUND, FIRST_BYTE, RECEIVE, CHECK } phase_t;
+
+    typedef struct event {
+        uint32_t us;
+        uint8_t phase;
+        uint8_t command;
+    } event_t;
+
+    static void record( phase_t phase, uint8_t command ) {
+        event_t &event = _events[_next++ % JBDBMS_TRACE_SIZE];
+        event.us = micros();
+        event.phase = phase;
+        event.command = command;
+    }
+
+    // Print recorded events, oldest first, and clear the buffer
+    static void dump( Print &out );
+
+    static const char *name( uint8_t phase );
+
+private:
+    static event_t _events[JBDBMS_TRACE_SIZE];
+    static uint32_t _next;
+};
+
+#else
+
+#define JBD_TRACE(phase, command)
+
+#endif
+
+#endif
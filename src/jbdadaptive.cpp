@@ -0,0 +1,88 @@
+#include <jbdadaptive.h>
+
+
+JbdAdaptiveRate::JbdAdaptiveRate( uint32_t min_ms, uint32_t max_ms, uint8_t decay_percent )
+    : _min(min_ms), _max(max_ms), _decay(decay_percent), 
+      _currentThreshold(50), _voltageThreshold(5), _spreadThreshold(5),
+      _period(min_ms), _haveStatus(false), _haveCells(false) {
+}
+
+void JbdAdaptiveRate::setThresholds( uint16_t current, uint16_t voltage, uint16_t spread ) {
+    _currentThreshold = current ? current : 1;
+    _voltageThreshold = voltage ? voltage : 1;
+    _spreadThreshold = spread ? spread : 1;
+}
+
+uint32_t JbdAdaptiveRate::update( const JbdBms::Status_t &status ) {
+    uint32_t activity = 0;
+    bool flipped = false;
+
+    if( _haveStatus ) {
+        flipped = status.mosfetStatus != _mosfetStatus || status.fault != _fault;
+        uint32_t current = percent(_current, status.current, _currentThreshold);
+        uint32_t voltage = percent(_voltage, status.voltage, _voltageThreshold);
+        activity = (current > voltage) ? current : voltage;
+    }
+
+    _haveStatus = true;
+    _current = status.current;
+    _voltage = status.voltage;
+    _fault = status.fault;
+    _mosfetStatus = status.mosfetStatus;
+
+    if( flipped ) {
+        return _period = _min;
+    }
+    return adapt(activity);
+}
+
+uint32_t JbdAdaptiveRate::update( const JbdBms::Cells_t &cells, uint8_t count ) {
+    if( !count ) {
+        return _period;
+    }
+    if( count > sizeof(cells.voltages)/sizeof(*cells.voltages) ) {
+        count = sizeof(cells.voltages)/sizeof(*cells.voltages);
+    }
+
+    uint16_t minCell = cells.voltages[0];
+    uint16_t maxCell = cells.voltages[0];
+    for( uint8_t i = 1; i < count; i++ ) {
+        if( cells.voltages[i] < minCell ) minCell = cells.voltages[i];
+        if( cells.voltages[i] > maxCell ) maxCell = cells.voltages[i];
+    }
+    uint16_t spread = maxCell - minCell;
+
+    uint32_t activity = _haveCells ? percent(_spread, spread, _spreadThreshold) : 0;
+    _haveCells = true;
+    _spread = spread;
+
+    // decay is done by status updates only, so it does not depend on the number of polls
+    return (activity >= 100) ? adapt(activity) : _period;
+}
+
+
+// Private Stuff
+
+// Shorten period on activity, else let it decay towards max
+uint32_t JbdAdaptiveRate::adapt( uint32_t activity_percent ) {
+    if( activity_percent >= 100 ) {
+        _period = (uint64_t)_period * 100 / (100 + activity_percent);
+    }
+    else {
+        _period += (uint64_t)_period * _decay / 100 + 1;
+    }
+
+    if( _period < _min ) _period = _min;
+    if( _period > _max ) _period = _max;
+
+    return _period;
+}
+
+// Change between prev and value in percent of threshold
+uint32_t JbdAdaptiveRate::percent( int32_t prev, int32_t value, uint16_t threshold ) {
+    int32_t diff = value - prev;
+    if( diff < 0 ) {
+        diff = -diff;
+    }
+    return (uint32_t)diff * 100 / threshold;
+}
@@ -0,0 +1,94 @@
+#include <jbdaggregator.h>
+
+
+JbdAggregator::JbdAggregator( uint32_t window_ms, handler_t handler )
+    : _handler(handler), _samples(0), _running(false) {
+    _aggregate.window = window_ms;
+}
+
+void JbdAggregator::add( const JbdBms::Status_t &status ) {
+    roll();
+    _samples++;
+    add(_aggregate.voltage, status.voltage);
+    add(_aggregate.current, status.current);
+    add(_aggregate.remainingCapacity, status.remainingCapacity);
+    add(_aggregate.currentCapacity, status.currentCapacity);
+
+    uint8_t ntcs = status.ntcs;
+    if( ntcs > sizeof(status.temperatures)/sizeof(*status.temperatures) ) {
+        ntcs = sizeof(status.temperatures)/sizeof(*status.temperatures);
+    }
+    for( uint8_t i = 0; i < ntcs; i++ ) {
+        add(_aggregate.temperatures[i], JbdBms::deciCelsius(status.temperatures[i]));
+    }
+    if( ntcs > _aggregate.ntcs ) {
+        _aggregate.ntcs = ntcs;
+    }
+
+    _aggregate.fault |= status.fault;
+}
+
+void JbdAggregator::add( const JbdBms::Cells_t &cells, uint8_t count ) {
+    roll();
+    _samples++;
+    if( count > sizeof(cells.voltages)/sizeof(*cells.voltages) ) {
+        count = sizeof(cells.voltages)/sizeof(*cells.voltages);
+    }
+    for( uint8_t i = 0; i < count; i++ ) {
+        add(_aggregate.cells[i], cells.voltages[i]);
+    }
+    if( count > _aggregate.cellCount ) {
+        _aggregate.cellCount = count;
+    }
+}
+
+void JbdAggregator::handle() {
+    if( _running && millis() - _aggregate.start >= _aggregate.window ) {
+        roll();
+    }
+}
+
+size_t JbdAggregator::influxFields( char *line, size_t maxlen, const char *name, const field_t &field ) {
+    int len = snprintf(line, maxlen, ",%s_min=%ld,%s_max=%ld,%s_mean=%ld,%s_last=%ld", 
+        name, (long)field.min, name, (long)field.max, name, (long)field.mean(), name, (long)field.last);
+    return (len > 0 && (size_t)len < maxlen) ? len : 0;
+}
+
+
+// Private Stuff
+
+// Report a finished window and start a new one if needed
+void JbdAggregator::roll() {
+    uint32_t now = millis();
+
+    if( _running ) {
+        if( now - _aggregate.start < _aggregate.window ) {
+            return;
+        }
+        if( _handler && _samples ) {
+            _handler(_aggregate);
+        }
+    }
+
+    uint32_t start = (_running && _aggregate.window)
+        ? _aggregate.start + (now - _aggregate.start) / _aggregate.window * _aggregate.window  // keep alignment
+        : now;
+    uint32_t window = _aggregate.window;
+    memset(&_aggregate, 0, sizeof(_aggregate));
+    _aggregate.start = start;
+    _aggregate.window = window;
+    _samples = 0;
+    _running = true;
+}
+
+void JbdAggregator::add( field_t &field, int32_t value ) {
+    if( !field.count || value < field.min ) {
+        field.min = value;
+    }
+    if( !field.count || value > field.max ) {
+        field.max = value;
+    }
+    field.last = value;
+    field.sum += value;
+    field.count++;
+}
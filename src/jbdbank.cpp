@@ -0,0 +1,180 @@
+#include <jbdbank.h>
+
+
+JbdBank::JbdBank( uint32_t max_age_ms )
+    : _count(0), _maxAge(max_age_ms), _voltageSum(0), _currentSum(0), _remainingSum(0), _nominalSum(0) {
+    memset(_packs, 0, sizeof(_packs));
+    memset(&_bank, 0, sizeof(_bank));
+}
+
+int JbdBank::add( JbdBms &bms ) {
+    if( _count >= MAX_PACKS ) {
+        return -1;
+    }
+
+    _bms[_count] = &bms;
+    return _count++;
+}
+
+bool JbdBank::poll() {
+    bool ok = true;
+
+    for( size_t i = 0; i < _count; i++ ) {
+        JbdBms::Status_t status;
+        JbdBms::Cells_t cells;
+        if( _bms[i]->getStatusAndCells(status, cells) ) {
+            update(i, status);
+            update(i, cells);
+        }
+        else {
+            invalidate(i);
+            ok = false;
+        }
+    }
+
+    return ok;
+}
+
+void JbdBank::update( size_t index, const JbdBms::Status_t &status ) {
+    if( index >= _count ) {
+        return;
+    }
+
+    pack_t &pack = _packs[index];
+    if( _bank.packMask & (1 << index) ) {
+        contribute(index, -1);
+    }
+    pack.status = status;
+    pack.time = millis();
+    pack.valid = true;
+    contribute(index, 1);
+
+    _bank.time = pack.time;
+    expire();
+    scan();
+}
+
+void JbdBank::update( size_t index, const JbdBms::Cells_t &cells ) {
+    if( index >= _count || !_packs[index].valid ) {
+        return;  // need the number of cells
+    }
+
+    pack_t &pack = _packs[index];
+    uint8_t count = pack.status.cells;
+    if( count > sizeof(cells.voltages)/sizeof(*cells.voltages) ) {
+        count = sizeof(cells.voltages)/sizeof(*cells.voltages);
+    }
+
+    pack.minCell = pack.maxCell = 0;
+    for( uint8_t i = 0; i < count; i++ ) {
+        uint16_t mV = cells.voltages[i];
+        if( !i || mV < pack.minCell ) {
+            pack.minCell = mV;
+            pack.minIndex = i;
+        }
+        if( !i || mV > pack.maxCell ) {
+            pack.maxCell = mV;
+            pack.maxIndex = i;
+        }
+    }
+
+    scan();
+}
+
+void JbdBank::invalidate( size_t index ) {
+    if( index >= _count ) {
+        return;
+    }
+
+    if( _bank.packMask & (1 << index) ) {
+        contribute(index, -1);
+    }
+    _packs[index].valid = false;
+    scan();
+}
+
+// Add (sign 1) or remove (sign -1) the status of a pack to or from the sums
+void JbdBank::contribute( size_t index, int sign ) {
+    const JbdBms::Status_t &status = _packs[index].status;
+
+    _voltageSum += sign * (int32_t)status.voltage;
+    _currentSum += sign * (int32_t)status.current;
+    _remainingSum += sign * (int32_t)status.remainingCapacity;
+    _nominalSum += sign * (int32_t)status.nominalCapacity;
+
+    if( sign > 0 ) {
+        _bank.packMask |= 1 << index;
+        _bank.packs++;
+    }
+    else {
+        _bank.packMask &= ~(1 << index);
+        _bank.packs--;
+    }
+}
+
+// Remove packs with samples too old compared to the newest one
+void JbdBank::expire() {
+    for( size_t i = 0; i < _count; i++ ) {
+        if( (_bank.packMask & (1 << i)) && _bank.time - _packs[i].time > _maxAge ) {
+            contribute(i, -1);
+        }
+    }
+}
+
+// Derive mean values and rescan min/max over the contributing packs
+void JbdBank::scan() {
+    bank_t &bank = _bank;
+
+    bank.voltage = bank.packs ? _voltageSum / bank.packs : 0;
+    bank.current = _currentSum;
+    bank.remainingCapacity = _remainingSum;
+    bank.nominalCapacity = _nominalSum;
+    bank.currentCapacity = _nominalSum ? (uint32_t)((uint64_t)_remainingSum * 100 / _nominalSum) : 0;
+
+    bank.spread = 0;
+    bank.minCell = bank.maxCell = 0;
+    bank.fault = 0;
+    bank.faultMask = 0;
+    bank.imbalance = 0;
+
+    bool first = true, firstCell = true;
+    int16_t minCurrent = 0, maxCurrent = 0;
+    for( size_t i = 0; i < _count; i++ ) {
+        if( !(bank.packMask & (1 << i)) ) {
+            continue;
+        }
+        const pack_t &pack = _packs[i];
+
+        if( bank.time - pack.time > bank.spread ) {
+            bank.spread = bank.time - pack.time;
+        }
+        if( pack.status.fault ) {
+            bank.fault |= pack.status.fault;
+            bank.faultMask |= 1 << i;
+        }
+        if( first || pack.status.current < minCurrent ) {
+            minCurrent = pack.status.current;
+        }
+        if( first || pack.status.current > maxCurrent ) {
+            maxCurrent = pack.status.current;
+        }
+        first = false;
+
+        if( !pack.maxCell ) {
+            continue;  // no cells yet
+        }
+        if( firstCell || pack.minCell < bank.minCell ) {
+            bank.minCell = pack.minCell;
+            bank.minCellPack = i;
+            bank.minCellIndex = pack.minIndex;
+        }
+        if( firstCell || pack.maxCell > bank.maxCell ) {
+            bank.maxCell = pack.maxCell;
+            bank.maxCellPack = i;
+            bank.maxCellIndex = pack.maxIndex;
+        }
+        firstCell = false;
+    }
+
+    bank.imbalance = maxCurrent - minCurrent;
+}
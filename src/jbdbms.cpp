@@ -1,4 +1,5 @@
 #include <jbdbms.h>
+#include <jbdtrace.h>
 
 
 // Debug
@@ -14,14 +15,14 @@ static void hex( const char *label, const uint8_t *data, size_t length ) {
 
 // Basic methods
 
-JbdBms::JbdBms( Stream &serial, uint32_t *prev, uint8_t command_delay_ms ) 
-    : _serial(serial), _delay(command_delay_ms), _prev(prev), _dir_pin(-1) {
+JbdBmsBase::JbdBmsBase( Stream &serial, uint32_t *prev, uint8_t command_delay_ms ) 
+    : _pipelining(false), _serial(serial), _delay(command_delay_ms), _prev(prev), _dir_pin(-1) {
     if (!_prev) {
         _prev = &_prev_local;
     }
 }
 
-void JbdBms::begin( int dir_pin ) {
+void JbdBmsBase::begin( int dir_pin ) {
     _dir_pin = dir_pin;
     if( _dir_pin >= 0 ) {
         pinMode(_dir_pin, OUTPUT);
@@ -29,18 +30,24 @@ void JbdBms::begin( int dir_pin ) {
     }
 }
 
-bool JbdBms::execute( request_header_t &header, uint8_t *command, uint8_t *result ) {
+bool JbdBmsBase::execute( request_header_t &header, uint8_t *command, uint8_t *result, size_t size ) {
+    return send(header, command) && receive(header.command, result, size);
+}
+
+bool JbdBmsBase::send( request_header_t &header, uint8_t *command ) {
     uint16_t crc;
     uint8_t stop = 0x77;
 
     if( !prepareCmd(header, command, crc) ) {
         return false;
     }
+    JBD_TRACE(BEGIN, header.command);
 
     uint32_t remaining = _delay - (millis() - *_prev);
     if( remaining <= _delay ) {
         delay(remaining);
     }
+    JBD_TRACE(GAP, header.command);
 
     if( _dir_pin >= 0 ) {
         digitalWrite(_dir_pin, HIGH);  // write mode
@@ -51,64 +58,59 @@ bool JbdBms::execute( request_header_t &header, uint8_t *command, uint8_t *resul
            && (_serial.write(command, header.length) == header.length)
            && (_serial.write((uint8_t *)&crc, sizeof(crc)) == sizeof(crc))
            && (_serial.write(&stop, sizeof(stop)) == sizeof(stop));
+    JBD_TRACE(WRITE, header.command);
     _serial.flush();  // wait until write is done 
+    JBD_TRACE(DRAIN, header.command);
 
     if( _dir_pin >= 0 ) {
         digitalWrite(_dir_pin, LOW);  // read mode (default)
     }
-
-    if( rc ) {
-        response_header_t header = {0};
-        rc = (_serial.readBytes((uint8_t *)&header, sizeof(header)) == sizeof(header))
-          && (header.start == 0xdd && header.length <= 64)
-          && (header.length == 0 || (result && _serial.readBytes(result, header.length) == header.length))
-          && (_serial.readBytes((uint8_t *)&crc, sizeof(crc)) == sizeof(crc))
-          && (_serial.readBytes(&stop, sizeof(stop)) == sizeof(stop))
-          && isValid(header, result, crc)
-          && header.returncode == 0;
-    }
+    JBD_TRACE(TURNAROUND, header.command);
 
     *_prev = millis();
 
     return rc;
 }
 
+bool JbdBmsBase::receive( uint8_t command, uint8_t *result, size_t size ) {
+    response_header_t header = { 0, command, 0, 0 };
+    uint16_t crc, expected;
+    uint8_t stop;
 
-// public Get-Commands
-
-bool JbdBms::getStatus( Status_t &data ) {
-    request_header_t header = { 0, READ, STATUS, 0 };
-    bool rc = execute(header, 0, (uint8_t *)&data);
-    swap(&data.voltage);
-    swap((uint16_t *)&data.current);
-    swap(&data.remainingCapacity);
-    swap(&data.nominalCapacity);
-    swap(&data.cycles);
-    swap(&data.productionDate);
-    swap(&data.balanceLow);
-    swap(&data.balanceHigh);
-    swap(&data.fault);
-    return rc;
-}
-    
-bool JbdBms::getCells( Cells_t &data ) {
-    request_header_t header = { 0, READ, CELLS, 0 };
-    bool rc = execute(header, 0, (uint8_t *)&data);
-    for (size_t i = 0; i < sizeof(data.voltages)/sizeof(*data.voltages); i++) {
-        swap(&data.voltages[i]);
+    // A response of an earlier, timed out request may still be in front of ours
+    bool rc = readHeader(header);
+    for( uint8_t skipped = 0; rc && header.command != command && skipped < 2; skipped++ ) {
+        rc = skipFrame(header) && readHeader(header);
     }
+
+    rc = rc && header.command == command
+      && readData(header, result, size, expected)
+      && (_serial.readBytes((uint8_t *)&crc, sizeof(crc)) == sizeof(crc))
+      && (_serial.readBytes(&stop, sizeof(stop)) == sizeof(stop));
+    JBD_TRACE(RECEIVE, command);
+
+    rc = rc && expected == crc
+      && header.returncode == 0;
+    JBD_TRACE(CHECK, command);
+
+    *_prev = millis();
+
     return rc;
 }
-    
-bool JbdBms::getHardware( Hardware_t &data ) {
+
+
+// public Get-Command
+
+bool JbdBmsBase::getHardware( Hardware_t &data ) {
     request_header_t header = { 0, READ, HARDWARE, 0 };
-    return execute(header, 0, (uint8_t *)&data);
+    memset(&data, 0, sizeof(data));
+    return execute(header, 0, (uint8_t *)&data, sizeof(data.id) - 1);  // keep EOS
 }
 
 
 // public Set-Command
 
-bool JbdBms::setMosfetStatus( mosfet_t status ) {
+bool JbdBmsBase::setMosfetStatus( mosfet_t status ) {
     request_header_t header = { 0, WRITE, MOSFET, 2 };
     uint8_t status_inv = ~status & MOSFET_BOTH;  // invert status pins
     uint8_t mosfetStatus[] = { 0, status_inv };
@@ -120,20 +122,14 @@ bool JbdBms::setMosfetStatus( mosfet_t status ) {
 
 // Calculate 16-bit crc of request
 // Return crc (0 on error)
-uint16_t JbdBms::genRequestCrc( request_header_t &header, uint8_t *data ) {
+uint16_t JbdBmsBase::genRequestCrc( request_header_t &header, uint8_t *data ) {
     return genCrc(header.command, header.length, data);
 }
 
-// Calculate 16-bit crc of response
-// Return crc (0 on error)
-uint16_t JbdBms::genResponseCrc( response_header_t &header, uint8_t *data ) {
-    return genCrc(header.returncode, header.length, data);
-}
-
-uint16_t JbdBms::genCrc( uint8_t byte, uint8_t len, uint8_t *data ) {
+uint16_t JbdBmsBase::genCrc( uint8_t byte, uint8_t len, uint8_t *data ) {
     uint16_t crc = 0;
 
-    if( len < 31 && (len == 0 || data)) {
+    if( len <= 64 && (len == 0 || data)) {  // up to 32 cells
         crc -= byte;
         crc -= len;
         while( len-- ) {
@@ -144,29 +140,78 @@ uint16_t JbdBms::genCrc( uint8_t byte, uint8_t len, uint8_t *data ) {
     return swap(&crc);
 }
 
-// Check crc of result
-// Return true if calculated and stored crc match 
-bool JbdBms::isValid( response_header_t &header, uint8_t *data, uint16_t crc ) {
-    return genResponseCrc(header, data) == crc;
-}
-
 // Set start and crc bytes of command
 // Return length of command or 0 on errors
-bool JbdBms::prepareCmd( request_header_t &header, uint8_t *data, uint16_t &crc ) {
+bool JbdBmsBase::prepareCmd( request_header_t &header, uint8_t *data, uint16_t &crc ) {
     header.start = 0xdd;
     crc = genRequestCrc(header, data);
     return crc != 0;
 }
 
 
+// Skip bytes until a frame start is found, then read the rest of the response header
+// Return true if a plausible header was read
+bool JbdBmsBase::readHeader( response_header_t &header ) {
+    for( size_t skipped = 0; skipped < sizeof(response_header_t) + 64 + 3; skipped++ ) {
+        if( _serial.readBytes(&header.start, 1) != 1 ) {
+            return false;
+        }
+        if( !skipped ) {
+            JBD_TRACE(FIRST_BYTE, header.command);  // expected or skipped command
+        }
+        if( header.start == 0xdd ) {
+            return (_serial.readBytes(&header.command, sizeof(header) - 1) == sizeof(header) - 1)
+                && header.length <= 64;
+        }
+    }
+    return false;
+}
+
+// Read data of a frame with given header, store up to size bytes of it in result (if not 0).
+// The checksum covers the dropped bytes as well.
+// Return true if all bytes were read, crc is the expected checksum then
+bool JbdBmsBase::readData( response_header_t &header, uint8_t *result, size_t size, uint16_t &crc ) {
+    size_t stored = result ? (header.length < size ? header.length : size) : 0;
+    if( stored && _serial.readBytes(result, stored) != stored ) {
+        return false;
+    }
+
+    crc = 0;
+    crc -= header.returncode;
+    crc -= header.length;
+    for( size_t i = 0; i < stored; i++ ) {
+        crc -= result[i];
+    }
+    uint8_t byte;
+    for( size_t remaining = header.length - stored; remaining; remaining-- ) {
+        if( _serial.readBytes(&byte, 1) != 1 ) {
+            return false;
+        }
+        crc -= byte;
+    }
+    swap(&crc);
+    return true;
+}
+
+// Read and drop data, crc and stop byte of a frame with given header
+// Return true if all bytes were read
+bool JbdBmsBase::skipFrame( response_header_t &header ) {
+    uint8_t byte;
+    for( size_t remaining = header.length + 3; remaining; remaining-- ) {
+        if( _serial.readBytes(&byte, 1) != 1 ) {
+            return false;
+        }
+    }
+    return true;
+}
+
 // Convert balance bits to string
 // WARNING: not thread safe: returns shared buffer
-const char *JbdBms::balance( const Status_t &data ) {
+const char *JbdBmsBase::balance( uint32_t balanceBits, uint8_t cells ) {
     static char balanceStr[33];
 
     char *balancePtr = balanceStr;
-    uint32_t balanceBits = (uint32_t)data.balanceHigh << 16 | data.balanceLow;
-    size_t cell = (data.cells < sizeof(balanceStr)) ? data.cells : sizeof(balanceStr) - 1;
+    size_t cell = (cells < sizeof(balanceStr)) ? cells : sizeof(balanceStr) - 1;
     while(cell--) {
         *(balancePtr++) = (balanceBits & 1) ? '1' : '0';
         balanceBits >>= 1;
@@ -0,0 +1,75 @@
+#include <jbdbmstcp.h>
+
+
+JbdBmsTcp::JbdBmsTcp( Client &client, const char *host, uint16_t port, uint32_t retry_ms )
+    : _client(client), _host(host), _port(port), _retry_ms(retry_ms), _connects(0), _len(0) {
+    _prev_connect = millis() - retry_ms;  // allow immediate first connect
+}
+
+bool JbdBmsTcp::connect() {
+    if( _client.connected() ) {
+        return true;
+    }
+
+    uint32_t now = millis();
+    if( now - _prev_connect < _retry_ms ) {
+        return false;
+    }
+    _prev_connect = now;
+
+    _client.stop();
+    if( !_client.connect(_host, _port) ) {
+        return false;
+    }
+
+    // Bytes from the bus received before we are in sync are useless.
+    // A collected request frame is kept: flush() connects just before sending it
+    while( _client.available() > 0 ) {
+        _client.read();
+    }
+    _connects++;
+    return true;
+}
+
+void JbdBmsTcp::stop() {
+    _client.stop();
+    _len = 0;
+}
+
+
+// Stream interface
+
+int JbdBmsTcp::available() {
+    return connect() ? _client.available() : 0;
+}
+
+int JbdBmsTcp::read() {
+    return connect() ? _client.read() : -1;
+}
+
+int JbdBmsTcp::peek() {
+    return connect() ? _client.peek() : -1;
+}
+
+size_t JbdBmsTcp::write( uint8_t byte ) {
+    return write(&byte, 1);
+}
+
+// Collect request bytes until flush()
+size_t JbdBmsTcp::write( const uint8_t *buffer, size_t size ) {
+    if( _len + size > sizeof(_frame) ) {
+        return 0;
+    }
+    memcpy(&_frame[_len], buffer, size);
+    _len += size;
+    return size;
+}
+
+void JbdBmsTcp::flush() {
+    if( _len && connect() ) {
+        if( _client.write(_frame, _len) != _len ) {
+            _client.stop();  // reconnect with next access
+        }
+    }
+    _len = 0;
+}
@@ -0,0 +1,146 @@
+#include <jbdbus.h>
+
+
+JbdBus::JbdBus() : _count(0), _seq(0), _overruns(0) {
+    memset(_slots, 0, sizeof(_slots));
+    memset(_refs, 0, sizeof(_refs));
+    for( size_t t = 0; t < TYPES; t++ ) {
+        _latest[t] = 0;
+        _refs[t][0] = 1;  // the bus holds the latest slot
+    }
+}
+
+int JbdBus::subscribe( topic_t topic, subscriber_t subscriber, bool changes ) {
+    if( _count >= MAX_SUBSCRIBERS || !subscriber ) {
+        return -1;
+    }
+
+    subscription_t &subscription = _subscriptions[_count];
+    subscription.topic = topic;
+    subscription.subscriber = subscriber;
+    subscription.changes = changes;
+
+    return _count++;
+}
+
+bool JbdBus::publish( const JbdBms::Status_t &status ) {
+    snapshot_t *next = slot(STATUS);
+    if( !next ) {
+        return false;
+    }
+
+    const snapshot_t &prev = latest(STATUS);
+    bool changed = !prev.seq || memcmp(&prev.status, &status, sizeof(status));
+    bool fault = prev.seq ? prev.status.fault != status.fault : status.fault != 0;
+
+    next->status = status;
+    commit(STATUS, next, changed);
+    if( fault ) {
+        notify(FAULT, true, true, *next);
+    }
+    return true;
+}
+
+bool JbdBus::publish( const JbdBms::Cells_t &cells ) {
+    snapshot_t *next = slot(CELLS);
+    if( !next ) {
+        return false;
+    }
+
+    const snapshot_t &prev = latest(CELLS);
+    bool changed = !prev.seq || memcmp(&prev.cells, &cells, sizeof(cells));
+
+    next->cells = cells;
+    commit(CELLS, next, changed);
+    return true;
+}
+
+bool JbdBus::publish( const JbdBms::Hardware_t &hardware ) {
+    snapshot_t *next = slot(HARDWARE);
+    if( !next ) {
+        return false;
+    }
+
+    const snapshot_t &prev = latest(HARDWARE);
+    bool changed = !prev.seq || memcmp(&prev.hardware, &hardware, sizeof(hardware));
+
+    next->hardware = hardware;
+    commit(HARDWARE, next, changed);
+    return true;
+}
+
+void JbdBus::fail( topic_t topic ) {
+    notify(topic, false, true, latest(topic));
+}
+
+bool JbdBus::publish( JbdBms::cmd_t command, bool ok, const JbdScheduler::data_t &data ) {
+    topic_t topic;
+    switch( command ) {
+        case JbdBms::STATUS:   topic = STATUS;   break;
+        case JbdBms::CELLS:    topic = CELLS;    break;
+        case JbdBms::HARDWARE: topic = HARDWARE; break;
+        default: return false;
+    }
+
+    if( !ok ) {
+        fail(topic);
+        return false;
+    }
+
+    switch( topic ) {
+        case STATUS: return publish(data.status);
+        case CELLS:  return publish(data.cells);
+        default:     return publish(data.hardware);
+    }
+}
+
+const JbdBus::snapshot_t &JbdBus::acquire( topic_t topic ) {
+    size_t t = type(topic);
+    _refs[t][_latest[t]]++;
+    return _slots[t][_latest[t]];
+}
+
+void JbdBus::release( const snapshot_t &snapshot ) {
+    for( size_t t = 0; t < TYPES; t++ ) {
+        if( &snapshot >= _slots[t] && &snapshot < &_slots[t][SLOTS] ) {
+            size_t i = &snapshot - _slots[t];
+            if( _refs[t][i] > (i == _latest[t] ? 1 : 0) ) {  // never drop the reference of the bus
+                _refs[t][i]--;
+            }
+            return;
+        }
+    }
+}
+
+// Free slot for the next sample of topic or 0 if all are held
+JbdBus::snapshot_t *JbdBus::slot( topic_t topic ) {
+    size_t t = type(topic);
+    for( size_t i = 0; i < SLOTS; i++ ) {
+        if( !_refs[t][i] ) {
+            return &_slots[t][i];
+        }
+    }
+    _overruns++;
+    return 0;
+}
+
+// Make next the latest snapshot of its type and tell the subscribers
+void JbdBus::commit( topic_t topic, snapshot_t *next, bool changed ) {
+    size_t t = type(topic);
+    _refs[t][_latest[t]]--;
+    _latest[t] = next - _slots[t];
+    _refs[t][_latest[t]]++;
+
+    next->seq = ++_seq;
+    next->time = millis();
+    notify(topic, true, changed, *next);
+}
+
+void JbdBus::notify( topic_t topic, bool ok, bool changed, const snapshot_t &snapshot ) {
+    for( size_t i = 0; i < _count; i++ ) {
+        const subscription_t &subscription = _subscriptions[i];
+        if( subscription.topic == topic && (changed || !subscription.changes) ) {
+            subscription.subscriber(topic, ok, snapshot);
+        }
+    }
+}
@@ -0,0 +1,156 @@
+#include <jbdcapture.h>
+
+
+JbdCapture::JbdCapture( record_t *storage, size_t size, size_t post )
+    : _storage(storage), _size(size), _post(post), _head(0), _count(0), _postLeft(0),
+      _faultMask(0xffff), _cellHigh(0), _cellLow(0), _currentStep(0),
+      _state(IDLE), _reason(NONE), _triggerTime(0), _haveStatus(false), _fault(0), _current(0) {
+    if( _post >= _size ) {
+        _post = _size ? _size - 1 : 0;  // keep at least the trigger record
+    }
+}
+
+void JbdCapture::setTriggers( uint16_t fault_mask, uint16_t cell_high_mV, uint16_t cell_low_mV, uint16_t current_step ) {
+    _faultMask = fault_mask;
+    _cellHigh = cell_high_mV;
+    _cellLow = cell_low_mV;
+    _currentStep = current_step;
+}
+
+void JbdCapture::arm() {
+    if( !_size ) {
+        return;
+    }
+
+    _head = 0;
+    _count = 0;
+    _postLeft = 0;
+    _state = ARMED;
+    _reason = NONE;
+    _triggerTime = 0;
+    _haveStatus = false;
+}
+
+bool JbdCapture::add( const JbdBms::Status_t &status ) {
+    if( _state != ARMED && _state != TRIGGERED ) {
+        return false;
+    }
+
+    record_t &record = push(JbdBms::STATUS);
+    record.status = status;
+    record.count = status.cells;
+
+    if( _state == TRIGGERED ) {
+        recorded();
+        return true;
+    }
+
+    if( _haveStatus ) {
+        int32_t step = (int32_t)status.current - _current;
+        if( status.fault & ~_fault & _faultMask ) {
+            fire(FAULT);
+        }
+        else if( _currentStep && (step >= _currentStep || -step >= _currentStep) ) {
+            fire(CURRENT_STEP);
+        }
+    }
+    _haveStatus = true;
+    _fault = status.fault;
+    _current = status.current;
+
+    return true;
+}
+
+bool JbdCapture::add( const JbdBms::Cells_t &cells, uint8_t count ) {
+    if( _state != ARMED && _state != TRIGGERED ) {
+        return false;
+    }
+
+    if( count > sizeof(cells.voltages)/sizeof(*cells.voltages) ) {
+        count = sizeof(cells.voltages)/sizeof(*cells.voltages);
+    }
+
+    record_t &record = push(JbdBms::CELLS);
+    record.cells = cells;
+    record.count = count;
+
+    if( _state == TRIGGERED ) {
+        recorded();
+        return true;
+    }
+
+    for( uint8_t i = 0; i < count; i++ ) {
+        uint16_t mV = cells.voltages[i];
+        if( _cellHigh && mV > _cellHigh ) {
+            fire(CELL_HIGH);
+            break;
+        }
+        if( _cellLow && mV && mV < _cellLow ) {
+            fire(CELL_LOW);
+            break;
+        }
+    }
+
+    return true;
+}
+
+size_t JbdCapture::triggerIndex() const {
+    size_t after = _post - _postLeft;  // records after the trigger
+    if( (_state != TRIGGERED && _state != FROZEN) || _count <= after ) {
+        return _count;  // no trigger record, e.g. manual trigger before the first sample
+    }
+    return _count - after - 1;
+}
+
+const char *JbdCapture::stateName( state_t state ) {
+    switch( state ) {
+        case IDLE:      return "idle";
+        case ARMED:     return "armed";
+        case TRIGGERED: return "triggered";
+        case FROZEN:    return "frozen";
+        default:        return "?";
+    }
+}
+
+const char *JbdCapture::reasonName( trigger_t reason ) {
+    switch( reason ) {
+        case NONE:         return "none";
+        case FAULT:        return "fault";
+        case CELL_HIGH:    return "cellHigh";
+        case CELL_LOW:     return "cellLow";
+        case CURRENT_STEP: return "currentStep";
+        case MANUAL:       return "manual";
+        default:           return "?";
+    }
+}
+
+// Next record of the ring, overwrites the oldest if full
+JbdCapture::record_t &JbdCapture::push( uint8_t command ) {
+    record_t &record = _storage[_head];
+    _head = (_head + 1) % _size;
+    if( _count < _size ) {
+        _count++;
+    }
+
+    record.time = millis();
+    record.command = command;
+    return record;
+}
+
+void JbdCapture::fire( trigger_t reason ) {
+    if( _state != ARMED ) {
+        return;
+    }
+
+    _reason = reason;
+    _triggerTime = millis();
+    _postLeft = _post;
+    _state = _post ? TRIGGERED : FROZEN;
+}
+
+// A post-trigger record was added
+void JbdCapture::recorded() {
+    if( _postLeft && !--_postLeft ) {
+        _state = FROZEN;
+    }
+}
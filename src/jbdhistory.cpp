@@ -0,0 +1,154 @@
+#include <jbdhistory.h>
+
+
+JbdHistory::JbdHistory( sample_t *storage, size_t size, uint32_t interval_s )
+    : _storage(storage), _size(size), _head(0), _count(0), _interval(interval_s ? interval_s : 1), _havePending(false) {
+    memset(&_pending, 0, sizeof(_pending));
+}
+
+void JbdHistory::add( uint32_t now, const JbdBms::Status_t &status ) {
+    if( !slot(now) ) {
+        return;
+    }
+
+    _pending.voltage = status.voltage;
+    _pending.current = status.current;
+    _pending.remainingCapacity = status.remainingCapacity;
+    _pending.fault |= status.fault;
+    _pending.temperature = status.ntcs ? JbdBms::deciCelsius(status.temperatures[0]) : 0;
+    _pending.currentCapacity = status.currentCapacity;
+    _pending.mosfetStatus = status.mosfetStatus;
+    _pending.hasStatus = true;
+}
+
+void JbdHistory::add( uint32_t now, const JbdBms::Cells_t &cells, uint8_t count ) {
+    if( !slot(now) ) {
+        return;
+    }
+
+    if( count > sizeof(cells.voltages)/sizeof(*cells.voltages) ) {
+        count = sizeof(cells.voltages)/sizeof(*cells.voltages);
+    }
+    for( uint8_t i = 0; i < count; i++ ) {
+        uint16_t mV = cells.voltages[i];
+        if( !_pending.minCell || mV < _pending.minCell ) {
+            _pending.minCell = mV;
+        }
+        if( mV > _pending.maxCell ) {
+            _pending.maxCell = mV;
+        }
+    }
+}
+
+bool JbdHistory::begin( query_t &query, uint32_t from, uint32_t to, uint32_t step ) {
+    query.from = from;
+    query.to = to;
+    query.step = step ? step : _interval;
+    query.pos = lowerBound(from);
+
+    return query.pos < _count && at(query.pos).time <= to;
+}
+
+bool JbdHistory::next( query_t &query, point_t &point ) const {
+    if( query.pos >= _count ) {
+        return false;
+    }
+
+    const sample_t *sample = &at(query.pos);
+    if( sample->time > query.to ) {
+        return false;
+    }
+
+    uint32_t bucket = query.from + (sample->time - query.from) / query.step * query.step;
+    int32_t voltage = 0, current = 0, temperature = 0;
+    uint16_t statusCount = 0;
+
+    memset(&point, 0, sizeof(point));
+    point.time = bucket;
+    while( true ) {
+        point.count++;
+        if( sample->hasStatus ) {
+            statusCount++;
+            voltage += sample->voltage;
+            current += sample->current;
+            temperature += sample->temperature;
+            point.remainingCapacity = sample->remainingCapacity;
+            point.currentCapacity = sample->currentCapacity;
+            point.mosfetStatus = sample->mosfetStatus;
+            point.fault |= sample->fault;
+        }
+        if( sample->minCell && (!point.minCell || sample->minCell < point.minCell) ) {
+            point.minCell = sample->minCell;
+        }
+        if( sample->maxCell > point.maxCell ) {
+            point.maxCell = sample->maxCell;
+        }
+
+        if( ++query.pos >= _count ) {
+            break;
+        }
+        sample = &at(query.pos);
+        if( sample->time > query.to || sample->time - bucket >= query.step ) {
+            break;
+        }
+    }
+
+    if( statusCount ) {
+        point.voltage = voltage / statusCount;
+        point.current = current / statusCount;
+        point.temperature = temperature / statusCount;
+    }
+    return true;
+}
+
+// Make sure the pending sample belongs to the interval of now. Return false if now is invalid
+bool JbdHistory::slot( uint32_t now ) {
+    if( !_size ) {
+        return false;
+    }
+
+    uint32_t start = now - now % _interval;
+    if( _havePending && start == _pending.time ) {
+        return true;
+    }
+
+    if( _havePending ) {
+        if( start < _pending.time ) {
+            _count = 0;  // clock went back: old samples would break the time order
+        }
+        else {
+            push();
+        }
+    }
+
+    memset(&_pending, 0, sizeof(_pending));
+    _pending.time = start;
+    _havePending = true;
+    return true;
+}
+
+// Store the pending sample, overwrite the oldest if full
+void JbdHistory::push() {
+    _storage[_head] = _pending;
+    _head = (_head + 1) % _size;
+    if( _count < _size ) {
+        _count++;
+    }
+}
+
+// Index of the first sample not older than time (_count if there is none)
+size_t JbdHistory::lowerBound( uint32_t time ) const {
+    size_t lo = 0, hi = _count;
+
+    while( lo < hi ) {
+        size_t mid = lo + (hi - lo) / 2;
+        if( at(mid).time < time ) {
+            lo = mid + 1;
+        }
+        else {
+            hi = mid;
+        }
+    }
+
+    return lo;
+}
@@ -0,0 +1,240 @@
+#include <jbdlog.h>
+#include <stdarg.h>
+
+
+// Append printf output at pos of buffer, as far as it fits
+static void append( char *buffer, size_t size, size_t &pos, const char *fmt, ... ) {
+    if( pos + 1 >= size ) {
+        return;
+    }
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(&buffer[pos], size - pos, fmt, args);
+    va_end(args);
+    if( len > 0 ) {
+        pos += ((size_t)len < size - pos) ? len : size - pos - 1;
+    }
+}
+
+
+JbdLog::JbdLog( uint8_t *storage, size_t size, const char *const *formats, uint8_t count )
+    : _storage(storage), _size(size), _head(0), _tail(0), _used(0),
+      _formats(formats), _count(count), _logged(0), _dropped(0) {
+    if( _count > MAX_FORMATS ) {
+        _count = MAX_FORMATS;
+    }
+    for( uint8_t i = 0; i < _count; i++ ) {
+        _argc[i] = conversions(_formats[i]);
+    }
+}
+
+bool JbdLog::log( uint8_t id, uint8_t priority, ... ) {
+    if( id >= _count ) {
+        return false;
+    }
+
+    uint32_t args[MAX_ARGS];
+    uint8_t argc = _argc[id] < MAX_ARGS ? _argc[id] : MAX_ARGS;
+    va_list ap;
+    va_start(ap, priority);
+    for( uint8_t i = 0; i < argc; i++ ) {
+        args[i] = va_arg(ap, unsigned int);
+    }
+    va_end(ap);
+
+    return record(id, priority, argc, args);
+}
+
+bool JbdLog::logArgs( uint8_t id, uint8_t priority, const uint32_t *args, uint8_t count ) {
+    if( id >= _count ) {
+        return false;
+    }
+
+    return record(id, priority, count < MAX_ARGS ? count : MAX_ARGS, args);
+}
+
+bool JbdLog::logArray( uint8_t id, uint8_t priority, const uint16_t *values, uint8_t count ) {
+    if( id >= _count ) {
+        return false;
+    }
+
+    uint32_t args[MAX_ARGS];
+    uint8_t argc = count < MAX_ARGS ? count : MAX_ARGS;
+    for( uint8_t i = 0; i < argc; i++ ) {
+        args[i] = values[i];
+    }
+
+    return record(id, priority, argc, args);
+}
+
+bool JbdLog::format( char *buffer, size_t size, uint8_t &priority ) {
+    if( !_used || !size ) {
+        return false;
+    }
+
+    uint8_t len = peek(0);
+    uint8_t id = peek(1);
+    priority = peek(2);
+    uint8_t argc = peek(3);
+    size_t offset = 4;
+    varint(offset);  // millis() is for the host decoder, syslog has its own time
+
+    const char *fmt = (id < _count) ? _formats[id] : "";
+    char spec[16] = "";
+    size_t pos = 0;
+    uint8_t arg = 0;
+
+    *buffer = '\0';
+    while( *fmt ) {
+        if( fmt[0] != '%' || fmt[1] == '%' ) {
+            if( pos + 1 < size ) {
+                buffer[pos++] = *fmt;
+                buffer[pos] = '\0';
+            }
+            fmt += (fmt[0] == '%') ? 2 : 1;
+            continue;
+        }
+
+        // Copy conversion without length modifiers: all arguments are 32 bit
+        size_t s = 0;
+        spec[s++] = *(fmt++);
+        while( *fmt && strchr("-+ #0123456789.", *fmt) && s < sizeof(spec) - 2 ) {
+            spec[s++] = *(fmt++);
+        }
+        while( *fmt && strchr("hlLqjzt", *fmt) ) {
+            fmt++;
+        }
+        if( !*fmt ) {
+            spec[0] = '\0';  // incomplete conversion at the end
+            break;
+        }
+        spec[s++] = *(fmt++);
+        spec[s] = '\0';
+
+        if( arg < argc ) {
+            append(buffer, size, pos, spec, varint(offset));
+            arg++;
+        }
+    }
+
+    // More arguments than conversions: repeat the last one
+    while( arg < argc && spec[0] ) {
+        append(buffer, size, pos, ",");
+        append(buffer, size, pos, spec, varint(offset));
+        arg++;
+    }
+
+    _tail = (_tail + 1 + len) % _size;
+    _used -= 1 + len;
+    return true;
+}
+
+size_t JbdLog::encode( char *buffer, size_t size, uint8_t &priority ) {
+    static const char hex[] = "0123456789abcdef";
+    size_t pos = 0;
+
+    priority = 0xff;
+    while( _used ) {
+        size_t len = 1 + peek(0);
+        if( pos + 2 * len + 1 > size ) {
+            break;
+        }
+        if( peek(2) < priority ) {
+            priority = peek(2);
+        }
+        for( size_t i = 0; i < len; i++ ) {
+            uint8_t byte = peek(i);
+            buffer[pos++] = hex[byte >> 4];
+            buffer[pos++] = hex[byte & 0xf];
+        }
+        _tail = (_tail + len) % _size;
+        _used -= len;
+    }
+
+    if( size ) {
+        buffer[pos] = '\0';
+    }
+    return pos;
+}
+
+uint8_t JbdLog::conversions( const char *format ) {
+    uint8_t count = 0;
+
+    while( format && (format = strchr(format, '%')) ) {
+        if( format[1] == '%' ) {
+            format += 2;
+        }
+        else {
+            count++;
+            format++;
+        }
+    }
+
+    return count;
+}
+
+
+// Private Stuff
+
+// Encode entry and append it to the ring, drop oldest entries if needed
+bool JbdLog::record( uint8_t id, uint8_t priority, uint8_t argc, const uint32_t *args ) {
+    uint8_t entry[MAX_ENTRY];
+    size_t len = 4;
+    uint32_t now = millis();
+
+    entry[1] = id;
+    entry[2] = priority;
+    entry[3] = argc;
+    for( uint8_t i = 0; i <= argc; i++ ) {
+        uint32_t value = i ? args[i - 1] : now;
+        do {
+            entry[len++] = (value & 0x7f) | (value > 0x7f ? 0x80 : 0);
+            value >>= 7;
+        } while( value );
+    }
+    entry[0] = len - 1;
+
+    if( len > _size ) {
+        _dropped++;
+        return false;
+    }
+    while( _size - _used < len ) {
+        drop();
+    }
+    for( size_t i = 0; i < len; i++ ) {
+        put(entry[i]);
+    }
+    _logged++;
+    return true;
+}
+
+void JbdLog::put( uint8_t byte ) {
+    _storage[_head] = byte;
+    _head = (_head + 1) % _size;
+    _used++;
+}
+
+// Decode varint at offset of the oldest entry and advance offset
+uint32_t JbdLog::varint( size_t &offset ) const {
+    uint32_t value = 0;
+    uint8_t shift = 0;
+    uint8_t byte;
+
+    do {
+        byte = peek(offset++);
+        if( shift < 32 ) {
+            value |= (uint32_t)(byte & 0x7f) << shift;
+        }
+        shift += 7;
+    } while( byte & 0x80 );
+
+    return value;
+}
+
+// Remove the oldest entry
+void JbdLog::drop() {
+    size_t len = 1 + peek(0);
+    _tail = (_tail + len) % _size;
+    _used -= len;
+    _dropped++;
+}
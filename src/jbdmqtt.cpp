@@ -0,0 +1,195 @@
+#include <jbdmqtt.h>
+
+
+// Topic name and decimals of the status fields
+static const struct {
+    const char *name;
+    uint8_t decimals;
+} fields[] = {
+    { "voltage", 2 },
+    { "current", 2 },
+    { "remainingCapacity", 2 },
+    { "nominalCapacity", 2 },
+    { "cycles", 0 },
+    { "balance", 0 },
+    { "fault", 0 },
+    { "currentCapacity", 0 },
+    { "mosfetStatus", 0 },
+    { "cells", 0 },
+    { "ntcs", 0 }
+};
+
+
+JbdMqtt::JbdMqtt( const char *prefix, publish_t publish, uint32_t interval_ms )
+    : _prefix(prefix), _publish(publish), _pending(0), _published(0), _suppressed(0), _limited(0), _failures(0) {
+    memset(_values, 0, sizeof(_values));
+    for( size_t i = 0; i < MAX_FIELDS; i++ ) {
+        _values[i].interval = interval_ms;
+    }
+
+    // State changes should not wait
+    _values[FAULT].interval = 0;
+    _values[MOSFET_STATUS].interval = 0;
+
+    setDeadband(VOLTAGE, 2);
+    setDeadband(CURRENT, 10);
+    setDeadband(TEMPERATURE, 5);
+    setDeadband(CELL, 5);
+}
+
+void JbdMqtt::setDeadband( field_t field, uint16_t deadband ) {
+    size_t end = (field == TEMPERATURE) ? CELL : (field == CELL) ? MAX_FIELDS : field + 1;
+    for( size_t i = field; i < end; i++ ) {
+        _values[i].deadband = deadband;
+    }
+}
+
+void JbdMqtt::setInterval( field_t field, uint32_t interval_ms ) {
+    size_t end = (field == TEMPERATURE) ? CELL : (field == CELL) ? MAX_FIELDS : field + 1;
+    for( size_t i = field; i < end; i++ ) {
+        _values[i].interval = interval_ms;
+    }
+}
+
+void JbdMqtt::add( const JbdBms::Status_t &status ) {
+    update(VOLTAGE, status.voltage);
+    update(CURRENT, status.current);
+    update(REMAINING_CAPACITY, status.remainingCapacity);
+    update(NOMINAL_CAPACITY, status.nominalCapacity);
+    update(CYCLES, status.cycles);
+    update(BALANCE, (int32_t)((uint32_t)status.balanceHigh << 16 | status.balanceLow));
+    update(FAULT, status.fault);
+    update(CURRENT_CAPACITY, status.currentCapacity);
+    update(MOSFET_STATUS, status.mosfetStatus);
+    update(CELLS, status.cells);
+    update(NTCS, status.ntcs);
+
+    uint8_t ntcs = status.ntcs;
+    if( ntcs > sizeof(status.temperatures)/sizeof(*status.temperatures) ) {
+        ntcs = sizeof(status.temperatures)/sizeof(*status.temperatures);
+    }
+    for( uint8_t i = 0; i < ntcs; i++ ) {
+        update(TEMPERATURE + i, JbdBms::deciCelsius(status.temperatures[i]));
+    }
+}
+
+void JbdMqtt::add( const JbdBms::Cells_t &cells, uint8_t count ) {
+    if( count > sizeof(cells.voltages)/sizeof(*cells.voltages) ) {
+        count = sizeof(cells.voltages)/sizeof(*cells.voltages);
+    }
+    for( uint8_t i = 0; i < count; i++ ) {
+        update(CELL + i, cells.voltages[i]);
+    }
+}
+
+size_t JbdMqtt::flush() {
+    if( !_pending ) {
+        return 0;
+    }
+
+    char name[MAX_TOPIC];
+    char value[16];
+    size_t count = 0;
+    uint32_t now = millis();
+    bool limited = false;
+
+    for( size_t i = 0; i < MAX_FIELDS && _pending; i++ ) {
+        value_t &v = _values[i];
+        if( !v.pending ) {
+            continue;
+        }
+        if( v.sent && now - v.time < v.interval ) {
+            limited = true;
+            continue;
+        }
+
+        topic(name, i);
+        payload(value, sizeof(value), i);
+        if( !_publish || !_publish(name, value, true) ) {
+            _failures++;
+            break;
+        }
+
+        v.published = v.current;
+        v.time = now;
+        v.sent = true;
+        v.pending = false;
+        _pending--;
+        _published++;
+        count++;
+    }
+
+    if( limited ) {
+        _limited++;
+    }
+    return count;
+}
+
+void JbdMqtt::invalidate() {
+    _pending = 0;
+    for( size_t i = 0; i < MAX_FIELDS; i++ ) {
+        value_t &v = _values[i];
+        v.sent = false;
+        v.pending = v.known;
+        if( v.pending ) {
+            _pending++;
+        }
+    }
+}
+
+
+// Private Stuff
+
+// New sample of a value: mark it pending if it left the deadband around the published value
+void JbdMqtt::update( size_t index, int32_t value ) {
+    value_t &v = _values[index];
+    v.current = value;
+    v.known = true;
+
+    int32_t diff = v.sent ? value - v.published : 0;
+    bool changed = !v.sent || diff > v.deadband || -diff > v.deadband;
+    if( changed && !v.pending ) {
+        v.pending = true;
+        _pending++;
+    }
+    else if( !changed ) {
+        if( v.pending ) {  // back within the deadband before it was published
+            v.pending = false;
+            _pending--;
+        }
+        if( diff ) {
+            _suppressed++;
+        }
+    }
+}
+
+void JbdMqtt::topic( char *buffer, size_t index ) const {
+    if( index < TEMPERATURE ) {
+        snprintf(buffer, MAX_TOPIC, "%s/status/%s", _prefix, fields[index].name);
+    }
+    else if( index < CELL ) {
+        snprintf(buffer, MAX_TOPIC, "%s/status/temperature%u", _prefix, (unsigned)(index - TEMPERATURE + 1));
+    }
+    else {
+        snprintf(buffer, MAX_TOPIC, "%s/cells/%u", _prefix, (unsigned)(index - CELL + 1));
+    }
+}
+
+// Format value as decimal number with the decimals of its field
+void JbdMqtt::payload( char *buffer, size_t size, size_t index ) const {
+    int32_t value = _values[index].current;
+    uint8_t decimals = (index < TEMPERATURE) ? fields[index].decimals : (index < CELL) ? 1 : 3;
+
+    if( !decimals ) {
+        snprintf(buffer, size, "%lu", (unsigned long)(uint32_t)value);
+        return;
+    }
+
+    uint32_t scale = 1;
+    for( uint8_t i = 0; i < decimals; i++ ) {
+        scale *= 10;
+    }
+    uint32_t magnitude = (value < 0) ? -(int64_t)value : value;
+    snprintf(buffer, size, "%s%lu.%0*lu", (value < 0) ? "-" : "",
+        (unsigned long)(magnitude / scale), decimals, (unsigned long)(magnitude % scale));
+}
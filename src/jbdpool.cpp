@@ -0,0 +1,42 @@
+#include <jbdpool.h>
+
+
+JbdPool::JbdPool( char *arena, size_t arena_size, size_t buffer_size )
+    : _arena(arena), _size(buffer_size), _count(0), _used(0), _highWater(0), _failures(0) {
+    if( _size ) {
+        _count = arena_size / _size;
+    }
+    if( _count > MAX_BUFFERS ) {
+        _count = MAX_BUFFERS;
+    }
+    memset(_owners, 0, sizeof(_owners));
+}
+
+char *JbdPool::acquire( const char *owner ) {
+    for( size_t i = 0; i < _count; i++ ) {
+        if( !_owners[i] ) {
+            _owners[i] = owner ? owner : "?";
+            if( ++_used > _highWater ) {
+                _highWater = _used;
+            }
+            char *buffer = &_arena[i * _size];
+            *buffer = '\0';
+            return buffer;
+        }
+    }
+
+    _failures++;
+    return 0;
+}
+
+void JbdPool::release( const char *buffer ) {
+    if( !buffer || buffer < _arena || buffer >= &_arena[_count * _size] ) {
+        return;
+    }
+
+    size_t i = (buffer - _arena) / _size;
+    if( _owners[i] ) {
+        _owners[i] = 0;
+        _used--;
+    }
+}
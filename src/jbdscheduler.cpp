@@ -0,0 +1,159 @@
+#include <jbdscheduler.h>
+
+
+JbdScheduler::JbdScheduler( JbdBms &bms, uint16_t slot_ms )
+    : _bms(bms), _slot(slot_ms), _count(0), _mosfetPending(false), _mosfetHandler(0) {
+    memset(&_mosfetStats, 0, sizeof(_mosfetStats));
+}
+
+int JbdScheduler::add( JbdBms::cmd_t command, uint32_t period_ms, uint8_t priority, uint32_t deadline_ms, handler_t handler ) {
+    if( _count >= MAX_POLLS || (command != JbdBms::STATUS && command != JbdBms::CELLS && command != JbdBms::HARDWARE) ) {
+        return -1;
+    }
+
+    poll_t &poll = _polls[_count];
+    poll.command = command;
+    poll.period = period_ms;
+    poll.deadline = deadline_ms ? deadline_ms : period_ms;
+    poll.due = millis() + _count * _slot;  // spread first runs over the bus timeline
+    poll.priority = priority;
+    poll.handler = handler;
+    memset(&poll.stats, 0, sizeof(poll.stats));
+
+    return _count++;
+}
+
+void JbdScheduler::setPeriod( int id, uint32_t period_ms, bool restart ) {
+    if( id >= 0 && (size_t)id < _count ) {
+        poll_t &poll = _polls[id];
+        uint32_t now = millis();
+        poll.period = period_ms;
+        if( restart ) {
+            poll.due = now;
+        }
+        else if( (int32_t)(poll.due - now) > (int32_t)period_ms ) {
+            poll.due = now + period_ms;  // due was advanced by a longer period: do not wait for it
+        }
+    }
+}
+
+uint32_t JbdScheduler::getPeriod( int id ) const {
+    return (id >= 0 && (size_t)id < _count) ? _polls[id].period : 0;
+}
+
+void JbdScheduler::resetStats() {
+    for( size_t i = 0; i < _count; i++ ) {
+        memset(&_polls[i].stats, 0, sizeof(_polls[i].stats));
+    }
+    memset(&_mosfetStats, 0, sizeof(_mosfetStats));
+}
+
+bool JbdScheduler::setMosfet( JbdBms::mosfet_t status, JbdBms::Status_t &data ) {
+    return confirmMosfet(status, millis(), data);
+}
+
+void JbdScheduler::requestMosfet( JbdBms::mosfet_t status, mosfet_handler_t handler ) {
+    _mosfetRequest = status;
+    _mosfetSince = millis();
+    _mosfetHandler = handler;
+    _mosfetPending = true;
+}
+
+bool JbdScheduler::handle() {
+    if( _mosfetPending ) {
+        _mosfetPending = false;
+        JbdBms::Status_t data = {0};
+        bool ok = confirmMosfet(_mosfetRequest, _mosfetSince, data);
+        if( _mosfetHandler ) {
+            _mosfetHandler(_mosfetRequest, ok, _mosfetStats.lastLatency, data);
+        }
+        return true;
+    }
+
+    uint32_t now = millis();
+    poll_t *next = 0;
+
+    for( size_t i = 0; i < _count; i++ ) {
+        poll_t &poll = _polls[i];
+        if( (int32_t)(now - poll.due) < 0 ) {
+            continue;  // not yet due
+        }
+        if( !next || poll.priority > next->priority 
+         || (poll.priority == next->priority && (int32_t)(poll.due - next->due) < 0) ) {
+            next = &poll;
+        }
+    }
+
+    if( !next ) {
+        return false;
+    }
+
+    uint32_t jitter = now - next->due;
+    next->stats.runs++;
+    next->stats.sumJitter += jitter;
+    if( jitter > next->stats.maxJitter ) {
+        next->stats.maxJitter = jitter;
+    }
+    if( jitter > next->deadline ) {
+        next->stats.misses++;
+    }
+
+    // Keep phase. If we are more than a period late, skip the lost runs
+    next->due += next->period;
+    if( !next->period ) {
+        next->due = now;  // as often as possible
+    }
+    else if( (int32_t)(now - next->due) >= 0 ) {
+        uint32_t lost = (now - next->due) / next->period + 1;
+        next->stats.misses += lost;
+        next->due += lost * next->period;
+    }
+
+    bool ok = run(next->command);
+    if( !ok ) {
+        next->stats.errors++;
+    }
+    if( next->handler ) {
+        next->handler(next->command, ok, _data);
+    }
+
+    return true;
+}
+
+bool JbdScheduler::run( JbdBms::cmd_t command ) {
+    memset(&_data, 0, sizeof(_data));
+    switch( command ) {
+        case JbdBms::STATUS:
+            return _bms.getStatus(_data.status);
+        case JbdBms::CELLS:
+            return _bms.getCells(_data.cells);
+        case JbdBms::HARDWARE:
+            return _bms.getHardware(_data.hardware);
+        default:
+            return false;
+    }
+}
+
+// Switch mosfets, update stats and pass the confirming status to status polls
+bool JbdScheduler::confirmMosfet( JbdBms::mosfet_t status, uint32_t since, JbdBms::Status_t &data ) {
+    bool ok = _bms.setMosfetStatus(status, data);
+
+    _mosfetStats.runs++;
+    _mosfetStats.lastLatency = millis() - since;
+    if( ok ) {
+        if( _mosfetStats.lastLatency > _mosfetStats.maxLatency ) {
+            _mosfetStats.maxLatency = _mosfetStats.lastLatency;
+        }
+        _data.status = data;
+        for( size_t i = 0; i < _count; i++ ) {
+            if( _polls[i].command == JbdBms::STATUS && _polls[i].handler ) {
+                _polls[i].handler(JbdBms::STATUS, true, _data);
+            }
+        }
+    }
+    else {
+        _mosfetStats.errors++;
+    }
+
+    return ok;
+}
@@ -0,0 +1,138 @@
+#include <jbdsim.h>
+
+
+JbdBmsSim::JbdBmsSim( uint8_t cells, uint8_t ntcs, uint32_t baud, uint32_t response_us )
+    : _baud(baud), _response_us(response_us), _requests(0), _requestLen(0), _responseLen(0), _responsePos(0) {
+    memset(&status, 0, sizeof(status));
+    memset(&this->cells, 0, sizeof(this->cells));
+    memset(&hardware, 0, sizeof(hardware));
+
+    if( cells > sizeof(this->cells.voltages)/sizeof(*this->cells.voltages) ) {
+        cells = sizeof(this->cells.voltages)/sizeof(*this->cells.voltages);
+    }
+    if( ntcs > sizeof(status.temperatures)/sizeof(*status.temperatures) ) {
+        ntcs = sizeof(status.temperatures)/sizeof(*status.temperatures);
+    }
+
+    // Plausible defaults for a LiFePO pack at room temperature
+    status.voltage = cells * 330;
+    status.current = -150;
+    status.remainingCapacity = 8000;
+    status.nominalCapacity = 10000;
+    status.cycles = 42;
+    status.productionDate = (22 << 9) | (10 << 5) | 24;
+    status.version = 0x10;
+    status.currentCapacity = 80;
+    status.mosfetStatus = JbdBms::MOSFET_BOTH;
+    status.cells = cells;
+    status.ntcs = ntcs;
+    for( uint8_t i = 0; i < ntcs; i++ ) {
+        uint16_t deciKelvin = 2731 + 250 + i;
+        status.temperatures[i].hi = deciKelvin >> 8;
+        status.temperatures[i].lo = deciKelvin & 0xff;
+    }
+    for( uint8_t i = 0; i < cells; i++ ) {
+        this->cells.voltages[i] = 3300 + i;
+    }
+    strcpy(hardware.id, "JBD-SIM");
+}
+
+
+// Stream interface
+
+int JbdBmsSim::available() {
+    if( _responsePos >= _responseLen ) {
+        return 0;
+    }
+    if( !_baud ) {
+        return _responseLen - _responsePos;
+    }
+
+    int32_t elapsed = micros() - _responseStart;
+    if( elapsed < 0 ) {
+        return 0;
+    }
+    size_t arrived = (uint64_t)elapsed * _baud / 10 / 1000000 + 1;
+    if( arrived > _responseLen ) {
+        arrived = _responseLen;
+    }
+    return (arrived > _responsePos) ? arrived - _responsePos : 0;
+}
+
+int JbdBmsSim::read() {
+    return available() ? _response[_responsePos++] : -1;
+}
+
+int JbdBmsSim::peek() {
+    return available() ? _response[_responsePos] : -1;
+}
+
+size_t JbdBmsSim::write( uint8_t byte ) {
+    if( !_requestLen && byte != 0xdd ) {
+        return 1;  // wait for frame start
+    }
+    if( _requestLen >= sizeof(_request) ) {
+        _requestLen = 0;  // garbage
+        return 1;
+    }
+
+    _request[_requestLen++] = byte;
+    if( _requestLen >= 4 && _requestLen == 4U + _request[3] + 3 ) {
+        respond();
+        _requestLen = 0;
+    }
+    return 1;
+}
+
+
+// Private Stuff
+
+// Build response to the complete request frame
+void JbdBmsSim::respond() {
+    uint8_t command = _request[2];
+    uint8_t len = _request[3];
+    uint8_t *data = &_response[4];
+
+    uint16_t crc = JbdBms::genCrc(command, len, &_request[4]);
+    if( memcmp(&crc, &_request[4 + len], sizeof(crc)) || _request[4 + len + 2] != 0x77 ) {
+        return;  // real devices do not answer broken requests either
+    }
+
+    uint8_t rc = JbdBms::OK;
+    len = 0;
+    if( _request[1] == JbdBms::READ && command == JbdBms::STATUS ) {
+        JbdBms::Status_t wire = status;
+        JbdBms::decodeStatus(wire);  // swap to device order
+        len = offsetof(JbdBms::Status_t, temperatures) + 2 * wire.ntcs;  // without the padding of the struct
+        memcpy(data, &wire, len);
+    }
+    else if( _request[1] == JbdBms::READ && command == JbdBms::CELLS ) {
+        JbdBms::Cells_t wire = cells;
+        JbdBms::decodeCells(wire);
+        len = 2 * status.cells;
+        memcpy(data, &wire, len);
+    }
+    else if( _request[1] == JbdBms::READ && command == JbdBms::HARDWARE ) {
+        len = strnlen(hardware.id, sizeof(hardware.id) - 1);
+        memcpy(data, hardware.id, len);
+    }
+    else if( _request[1] == JbdBms::WRITE && command == JbdBms::MOSFET && _request[3] == 2 ) {
+        status.mosfetStatus = ~_request[5] & JbdBms::MOSFET_BOTH;  // status bits are inverted
+    }
+    else {
+        rc = JbdBms::ERR;
+    }
+
+    _response[0] = 0xdd;
+    _response[1] = command;
+    _response[2] = rc;
+    _response[3] = len;
+    crc = JbdBms::genCrc(rc, len, data);
+    memcpy(&data[len], &crc, sizeof(crc));
+    data[len + 2] = 0x77;
+
+    _responseLen = 4 + len + 3;
+    _responsePos = 0;
+    _responseStart = micros() + _response_us;
+    _requests++;
+}
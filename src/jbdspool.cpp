@@ -0,0 +1,158 @@
+#include <jbdspool.h>
+
+
+JbdSpool::JbdSpool( fs::FS &fs, const char *path, uint8_t segments, uint32_t segment_size, uint32_t drain_interval_ms )
+    : _fs(fs), _path(path), _segments(segments ? segments : 1), _segment_size(segment_size),
+      _interval(drain_interval_ms), _head(0), _tail(1), _size(0), _offset(0), _batch(0), _evicted(0), _dropped(0), _rotate(true) {
+    _prev_batch = millis() - drain_interval_ms;
+}
+
+void JbdSpool::begin() {
+    bool found = false;
+
+    for( uint8_t slot = 0; slot < _segments; slot++ ) {
+        snprintf(_name, sizeof(_name), "%s%u.log", _path, slot);
+        if( !_fs.exists(_name) ) {
+            continue;
+        }
+        File file = _fs.open(_name, "r");
+        uint32_t seq;
+        bool ok = file && file.read((uint8_t *)&seq, sizeof(seq)) == sizeof(seq) && seq % _segments == slot;
+        file.close();
+        if( !ok ) {
+            _fs.remove(_name);  // not one of ours or broken
+            continue;
+        }
+        if( !found || seq > _head ) _head = seq;
+        if( !found || seq < _tail ) _tail = seq;
+        found = true;
+    }
+
+    _offset = sizeof(uint32_t);
+    _batch = 0;
+    _rotate = true;
+}
+
+bool JbdSpool::append( const void *data, uint16_t len ) {
+    if( _rotate || _size + sizeof(len) + len > _segment_size ) {
+        if( !rotate() ) {
+            return false;
+        }
+    }
+
+    File file = _fs.open(name(_head), "a");
+    bool ok = file 
+        && file.write((const uint8_t *)&len, sizeof(len)) == sizeof(len)
+        && file.write((const uint8_t *)data, len) == len;
+    file.close();
+
+    _size += sizeof(len) + len;
+    _rotate = !ok;
+    return ok;
+}
+
+size_t JbdSpool::batch( uint8_t *buffer, size_t maxlen, char separator ) {
+    _batch = 0;
+    if( empty() || millis() - _prev_batch < _interval ) {
+        return 0;
+    }
+    _prev_batch = millis();
+
+    File file = _fs.open(name(_tail), "r");
+    if( !file || !file.seek(_offset) ) {
+        if( _tail != _head ) {
+            _tail++;  // lost segment, continue with the next one
+            _offset = sizeof(uint32_t);
+        }
+        return 0;
+    }
+
+    size_t used = 0;
+    uint32_t size = file.size();
+    uint16_t len;
+    while( file.read((uint8_t *)&len, sizeof(len)) == sizeof(len) ) {
+        if( used && used + len + 1 > maxlen ) {
+            break;  // for the next batch
+        }
+        uint32_t end = _offset + _batch + sizeof(len) + len;
+        if( (size_t)len + 1 > maxlen || end > size || file.read(&buffer[used], len) != len ) {
+            if( used ) {
+                break;  // drop it as first record of the next batch
+            }
+            // Record is too long for any batch or incomplete: drop it, else it blocks all records after it
+            _offset = end < size ? end : size;
+            _dropped++;
+            if( !file.seek(_offset) ) {
+                break;
+            }
+            continue;
+        }
+        used += len;
+        buffer[used++] = separator;
+        _batch += sizeof(len) + len;
+    }
+    file.close();
+
+    if( !used ) {
+        advance(0, size);  // tail segment may be done after dropped records
+    }
+    return used;
+}
+
+void JbdSpool::commit() {
+    if( empty() || !_batch ) {
+        return;
+    }
+
+    File file = _fs.open(name(_tail), "r");
+    uint32_t size = file ? file.size() : 0;
+    file.close();
+
+    advance(_batch, size);
+    _batch = 0;
+}
+
+
+// Private Stuff
+
+const char *JbdSpool::name( uint32_t seq ) {
+    snprintf(_name, sizeof(_name), "%s%u.log", _path, (unsigned)(seq % _segments));
+    return _name;
+}
+
+// Move read position, remove the tail segment once it is completely read
+void JbdSpool::advance( uint32_t bytes, uint32_t size ) {
+    _offset += bytes;
+    if( _offset >= size ) {
+        _fs.remove(name(_tail));
+        if( _tail++ == _head ) {
+            _rotate = true;  // spool is empty now
+        }
+        _offset = sizeof(uint32_t);
+    }
+}
+
+// Start a new head segment, evict the oldest if all slots are used
+bool JbdSpool::rotate() {
+    uint32_t seq = _head + 1;
+
+    if( empty() ) {
+        _tail = seq;
+        _offset = sizeof(uint32_t);
+    }
+    else if( seq - _tail >= _segments ) {
+        _fs.remove(name(_tail++));
+        _offset = sizeof(uint32_t);
+        _batch = 0;
+        _evicted++;
+    }
+
+    File file = _fs.open(name(seq), "w");
+    bool ok = file && file.write((const uint8_t *)&seq, sizeof(seq)) == sizeof(seq);
+    file.close();
+
+    _head = seq;  // even if not ok, so a broken file is never appended to
+    _size = sizeof(seq);
+    _rotate = !ok;
+    return ok;
+}
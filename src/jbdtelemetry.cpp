@@ -0,0 +1,261 @@
+#include <jbdtelemetry.h>
+
+
+// Sequential writer and reader of frame fields. Overflow is sticky and checked once at the end
+
+typedef struct writer {
+    uint8_t *buffer;
+    size_t size;
+    size_t pos;
+    bool ok;
+} writer_t;
+
+typedef struct reader {
+    const uint8_t *frame;
+    size_t len;
+    size_t pos;
+    bool ok;
+} reader_t;
+
+static void putByte( writer_t &w, uint8_t byte ) {
+    if( w.pos < w.size ) {
+        w.buffer[w.pos++] = byte;
+    }
+    else {
+        w.ok = false;
+    }
+}
+
+static void putVarint( writer_t &w, uint32_t value ) {
+    do {
+        putByte(w, (value & 0x7f) | (value > 0x7f ? 0x80 : 0));
+        value >>= 7;
+    } while( value );
+}
+
+static void putZigzag( writer_t &w, int32_t value ) {
+    putVarint(w, ((uint32_t)value << 1) ^ (uint32_t)(value >> 31));
+}
+
+// Append count values of width bits each, lsb first
+static void putBits( writer_t &w, const uint16_t *values, uint8_t count, uint16_t min, uint8_t width ) {
+    uint32_t bits = 0;
+    uint8_t used = 0;
+
+    for( uint8_t i = 0; i < count && width; i++ ) {
+        bits |= (uint32_t)(values[i] - min) << used;
+        used += width;
+        while( used >= 8 ) {
+            putByte(w, bits);
+            bits >>= 8;
+            used -= 8;
+        }
+    }
+    if( used ) {
+        putByte(w, bits);
+    }
+}
+
+static uint8_t getByte( reader_t &r ) {
+    if( r.pos < r.len ) {
+        return r.frame[r.pos++];
+    }
+    r.ok = false;
+    return 0;
+}
+
+static uint32_t getVarint( reader_t &r ) {
+    uint32_t value = 0;
+    uint8_t byte;
+
+    for( uint8_t shift = 0; r.ok; shift += 7 ) {
+        byte = getByte(r);
+        if( shift < 32 ) {
+            value |= (uint32_t)(byte & 0x7f) << shift;
+        }
+        if( !(byte & 0x80) ) {
+            break;
+        }
+    }
+    return value;
+}
+
+static int32_t getZigzag( reader_t &r ) {
+    uint32_t value = getVarint(r);
+    return (int32_t)(value >> 1) ^ -(int32_t)(value & 1);
+}
+
+static void getBits( reader_t &r, uint16_t *values, uint8_t count, uint16_t min, uint8_t width ) {
+    uint32_t bits = 0;
+    uint8_t have = 0;
+
+    for( uint8_t i = 0; i < count; i++ ) {
+        while( have < width ) {
+            bits |= (uint32_t)getByte(r) << have;
+            have += 8;
+        }
+        values[i] = min + (bits & ((1UL << width) - 1));
+        bits >>= width;
+        have -= width;
+    }
+}
+
+
+size_t JbdTelemetry::encode( uint8_t *buffer, size_t size, const JbdBms::Status_t *status,
+        const JbdBms::Cells_t *cells, uint8_t count, bool details ) {
+    writer_t w = { buffer, size, 0, true };
+    uint8_t flags = 0;
+
+    if( status ) {
+        flags |= STATUS | (status->mosfetStatus & MOSFET_MASK);
+        if( status->fault ) {
+            flags |= FAULT;
+        }
+        if( status->balanceLow || status->balanceHigh ) {
+            flags |= BALANCE;
+        }
+        if( details ) {
+            flags |= DETAILS;
+        }
+    }
+    if( cells && count ) {
+        flags |= CELLS;
+    }
+
+    putByte(w, VERSION);
+    putByte(w, flags);
+
+    if( status ) {
+        uint8_t ntcs = status->ntcs;
+        if( ntcs > sizeof(status->temperatures)/sizeof(*status->temperatures) ) {
+            ntcs = sizeof(status->temperatures)/sizeof(*status->temperatures);
+        }
+        uint8_t statusCells = status->cells < 32 ? status->cells : 32;
+
+        putVarint(w, status->voltage);
+        putZigzag(w, status->current);
+        putVarint(w, status->remainingCapacity);
+        putByte(w, status->currentCapacity);
+        putByte(w, statusCells);
+        putByte(w, ntcs);
+
+        int32_t prev = 0;
+        for( uint8_t i = 0; i < ntcs; i++ ) {
+            int32_t temperature = JbdBms::deciCelsius(status->temperatures[i]);
+            putZigzag(w, temperature - prev);
+            prev = temperature;
+        }
+
+        if( flags & DETAILS ) {
+            putVarint(w, status->nominalCapacity);
+            putVarint(w, status->cycles);
+            putVarint(w, status->productionDate);
+            putByte(w, status->version);
+        }
+        if( flags & FAULT ) {
+            putVarint(w, status->fault);
+        }
+        if( flags & BALANCE ) {
+            uint32_t balance = (uint32_t)status->balanceHigh << 16 | status->balanceLow;
+            for( uint8_t i = 0; i < statusCells; i += 8 ) {
+                putByte(w, balance >> i);
+            }
+        }
+    }
+
+    if( flags & CELLS ) {
+        if( count > sizeof(cells->voltages)/sizeof(*cells->voltages) ) {
+            count = sizeof(cells->voltages)/sizeof(*cells->voltages);
+        }
+        uint16_t min = cells->voltages[0], max = cells->voltages[0];
+        for( uint8_t i = 1; i < count; i++ ) {
+            if( cells->voltages[i] < min ) {
+                min = cells->voltages[i];
+            }
+            if( cells->voltages[i] > max ) {
+                max = cells->voltages[i];
+            }
+        }
+        uint8_t width = 0;
+        while( (uint32_t)(max - min) >> width ) {
+            width++;
+        }
+
+        putByte(w, count);
+        putVarint(w, min);
+        putByte(w, width);
+        putBits(w, cells->voltages, count, min, width);
+    }
+
+    return w.ok ? w.pos : 0;
+}
+
+bool JbdTelemetry::decode( const uint8_t *frame, size_t len, JbdBms::Status_t &status,
+        JbdBms::Cells_t &cells, uint8_t &contents ) {
+    reader_t r = { frame, len, 0, true };
+
+    memset(&status, 0, sizeof(status));
+    memset(&cells, 0, sizeof(cells));
+    contents = 0;
+
+    if( getByte(r) != VERSION ) {
+        return false;
+    }
+    uint8_t flags = getByte(r);
+
+    if( flags & STATUS ) {
+        status.mosfetStatus = flags & MOSFET_MASK;
+        status.voltage = getVarint(r);
+        status.current = getZigzag(r);
+        status.remainingCapacity = getVarint(r);
+        status.currentCapacity = getByte(r);
+        status.cells = getByte(r);
+        uint8_t ntcs = getByte(r);
+        if( ntcs > sizeof(status.temperatures)/sizeof(*status.temperatures) || status.cells > 32 ) {
+            return false;
+        }
+        status.ntcs = ntcs;
+
+        int32_t temperature = 0;
+        for( uint8_t i = 0; i < ntcs; i++ ) {
+            temperature += getZigzag(r);
+            uint16_t deciKelvin = temperature + 2731;
+            status.temperatures[i].hi = deciKelvin >> 8;
+            status.temperatures[i].lo = deciKelvin & 0xff;
+        }
+
+        if( flags & DETAILS ) {
+            status.nominalCapacity = getVarint(r);
+            status.cycles = getVarint(r);
+            status.productionDate = getVarint(r);
+            status.version = getByte(r);
+        }
+        if( flags & FAULT ) {
+            status.fault = getVarint(r);
+        }
+        if( flags & BALANCE ) {
+            uint32_t balance = 0;
+            for( uint8_t i = 0; i < status.cells; i += 8 ) {
+                balance |= (uint32_t)getByte(r) << i;
+            }
+            status.balanceLow = balance & 0xffff;
+            status.balanceHigh = balance >> 16;
+        }
+    }
+
+    if( flags & CELLS ) {
+        uint8_t count = getByte(r);
+        uint16_t min = getVarint(r);
+        uint8_t width = getByte(r);
+        if( count > sizeof(cells.voltages)/sizeof(*cells.voltages) || width > 16 ) {
+            return false;
+        }
+        getBits(r, cells.voltages, count, min, width);
+        if( !(flags & STATUS) ) {
+            status.cells = count;
+        }
+    }
+
+    contents = flags;
+    return r.ok;
+}
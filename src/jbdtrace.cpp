@@ -0,0 +1,27 @@
+#include <jbdtrace.h>
+
+#ifdef JBDBMS_TRACE
+
+JbdTrace::event_t JbdTrace::_events[JBDBMS_TRACE_SIZE];
+uint32_t JbdTrace::_next = 0;
+
+
+void JbdTrace::dump( Print &out ) {
+    uint32_t count = (_next < JBDBMS_TRACE_SIZE) ? _next : JBDBMS_TRACE_SIZE;
+    char line[40];
+
+    for( uint32_t i = _next - count; i != _next; i++ ) {
+        const event_t &event = _events[i % JBDBMS_TRACE_SIZE];
+        snprintf(line, sizeof(line), "jbdtrace,%lu,%s,%u\n", 
+            (unsigned long)event.us, name(event.phase), event.command);
+        out.print(line);
+    }
+    _next = 0;
+}
+
+const char *JbdTrace::name( uint8_t phase ) {
+    static const char *names[] = { "BEGIN", "GAP", "WRITE", "DRAIN", "TURNAROUND", "FIRST_BYTE", "RECEIVE", "CHECK" };
+    return (phase < sizeof(names)/sizeof(*names)) ? names[phase] : "?";
+}
+
+#endif
@@ -0,0 +1,470 @@
+/*
+Columnar batch decoder for archives of Jiabaida BMS response frames
+
+Reads archived status (0x03) and cell voltage (0x04) response frames, validates their checksums
+and decodes them into columns (structure of arrays) in parallel threads. Byte swapping and
+checksums use SSSE3/SSE2 kernels if the compiler targets them, scalar loops otherwise.
+
+This is a host tool, not part of the Arduino library. Build it with
+    g++ -O3 -march=native -pthread -o jbdcolumns jbdcolumns.cpp
+
+Usage:
+    jbdcolumns [-j threads] [--raw] archive [columns.jbdc]   decode archive, write columns if given
+    jbdcolumns [-j threads] [--raw] --bench archive           decode with 1..threads threads and compare
+
+Archive format (default): records of uint32_t time (unix seconds), uint16_t pack id (both little endian),
+followed by one complete response frame (0xdd, command, returncode, length, data, checksum, 0x77).
+With --raw the archive is just concatenated frames (time and pack are 0).
+Unknown commands, broken records and frames with bad checksum or returncode are counted and skipped.
+
+Columns file format (all little endian):
+    "JBDC", uint32_t version (1), then row groups until end of file:
+    uint8_t table (3=status, 4=cells), uint32_t rows, uint16_t columns, then for each column:
+    uint8_t name length, name, uint8_t type ('u' unsigned, 'i' signed), uint8_t bytes per value, rows values
+Status columns: time pack voltage current remainingCapacity nominalCapacity cycles productionDate
+    balanceLow balanceHigh fault version currentCapacity mosfetStatus cells ntcs temperature1..8 (0.1 degC, 0 if missing)
+Cells columns: time pack cells voltage1..32 (mV, 0 if missing)
+Units are those of the device (see include/jbdbms.h).
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+*/
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+
+static const uint8_t STATUS = 3;
+static const uint8_t CELLS = 4;
+static const size_t MAX_CELLS = 32;
+static const size_t MAX_NTCS = 8;
+static const size_t STATUS_FIXED = 23;  // status data bytes without temperatures
+static const size_t BLOCK_SIZE = 64 << 20;  // archive bytes decoded at once
+
+
+// Kernels
+
+// Sum of len bytes
+static inline uint32_t byteSum( const uint8_t *data, size_t len ) {
+    uint32_t sum = 0;
+    size_t i = 0;
+#if defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for( ; i + 16 <= len; i += 16 ) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)&data[i]);
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(bytes, _mm_setzero_si128()));
+    }
+    sum = _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#endif
+    for( ; i < len; i++ ) {
+        sum += data[i];
+    }
+    return sum;
+}
+
+// Convert count big endian uint16_t to host order
+static inline void swap16( const uint8_t *src, uint16_t *dst, size_t count ) {
+    size_t i = 0;
+#if defined(__SSSE3__)
+    const __m128i order = _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    for( ; i + 8 <= count; i += 8 ) {
+        __m128i words = _mm_loadu_si128((const __m128i *)&src[2 * i]);
+        _mm_storeu_si128((__m128i *)&dst[i], _mm_shuffle_epi8(words, order));
+    }
+#endif
+    for( ; i < count; i++ ) {
+        dst[i] = (uint16_t)src[2 * i] << 8 | src[2 * i + 1];
+    }
+}
+
+// Response checksum is -sum(returncode, length, data), stored big endian after the data
+static inline bool isValid( const uint8_t *frame ) {
+    uint8_t len = frame[3];
+    uint16_t crc = (uint16_t)frame[4 + len] << 8 | frame[5 + len];
+    return (uint16_t)(crc + byteSum(&frame[2], 2 + len)) == 0 && frame[2] == 0;
+}
+
+
+// Frame index of one archive block
+
+typedef struct frame {
+    const uint8_t *data;  // points to 0xdd
+    uint32_t time;
+    uint16_t pack;
+} frame_t;
+
+typedef struct counts {
+    uint64_t status, cells, invalid, skipped;  // skipped: bytes without a plausible frame
+} counts_t;
+
+// Find frames in buffer. Return number of bytes consumed (rest is an incomplete record)
+static size_t indexFrames( const uint8_t *buf, size_t size, bool raw,
+                           std::vector<frame_t> &status, std::vector<frame_t> &cells, counts_t &counts ) {
+    size_t header = raw ? 0 : 6;
+    size_t pos = 0;
+
+    while( pos + header + 7 <= size ) {
+        const uint8_t *frame = &buf[pos + header];
+        size_t total = header + 7 + frame[3];
+        bool plausible = frame[0] == 0xdd && frame[3] <= 2 * MAX_CELLS && (frame[1] == STATUS || frame[1] == CELLS);
+        if( plausible && pos + total > size ) {
+            break;  // continue with next block
+        }
+        if( !plausible || frame[6 + frame[3]] != 0x77 ) {
+            pos++;  // resync
+            counts.skipped++;
+            continue;
+        }
+
+        frame_t entry = { frame, 0, 0 };
+        if( !raw ) {
+            memcpy(&entry.time, &buf[pos], sizeof(entry.time));
+            memcpy(&entry.pack, &buf[pos + 4], sizeof(entry.pack));
+        }
+        (frame[1] == STATUS ? status : cells).push_back(entry);
+        pos += total;
+    }
+
+    return pos;
+}
+
+
+// Columns
+
+typedef struct status_columns {
+    std::vector<uint8_t> valid;
+    std::vector<uint32_t> time;
+    std::vector<uint16_t> pack;
+    std::vector<uint16_t> words[9];  // voltage .. fault as in the frame
+    std::vector<uint8_t> bytes[5];   // version .. ntcs as in the frame
+    std::vector<int16_t> temperature[MAX_NTCS];
+
+    void resize( size_t rows ) {
+        valid.resize(rows); time.resize(rows); pack.resize(rows);
+        for( auto &column : words ) column.resize(rows);
+        for( auto &column : bytes ) column.resize(rows);
+        for( auto &column : temperature ) column.resize(rows);
+    }
+} status_columns_t;
+
+typedef struct cells_columns {
+    std::vector<uint8_t> valid;
+    std::vector<uint32_t> time;
+    std::vector<uint16_t> pack;
+    std::vector<uint8_t> cells;
+    std::vector<uint16_t> voltage[MAX_CELLS];
+
+    void resize( size_t rows ) {
+        valid.resize(rows); time.resize(rows); pack.resize(rows); cells.resize(rows);
+        for( auto &column : voltage ) column.resize(rows);
+    }
+} cells_columns_t;
+
+static void decodeStatus( const std::vector<frame_t> &frames, status_columns_t &columns, size_t from, size_t to ) {
+    uint16_t words[9 + MAX_NTCS];
+
+    for( size_t row = from; row < to; row++ ) {
+        const uint8_t *frame = frames[row].data;
+        const uint8_t *data = &frame[4];
+        uint8_t len = frame[3];
+        bool valid = len >= STATUS_FIXED && isValid(frame);
+        columns.valid[row] = valid;
+        columns.time[row] = frames[row].time;
+        columns.pack[row] = frames[row].pack;
+        if( !valid ) {
+            continue;
+        }
+
+        size_t ntcs = std::min<size_t>(std::min<size_t>(data[22], MAX_NTCS), (len - STATUS_FIXED) / 2);
+        swap16(data, words, 9);
+        for( size_t i = 0; i < 9; i++ ) {
+            columns.words[i][row] = words[i];
+        }
+        for( size_t i = 0; i < 5; i++ ) {
+            columns.bytes[i][row] = data[18 + i];
+        }
+        swap16(&data[STATUS_FIXED], words, ntcs);
+        for( size_t i = 0; i < MAX_NTCS; i++ ) {
+            columns.temperature[i][row] = (i < ntcs) ? (int16_t)(words[i] - 2731) : 0;
+        }
+    }
+}
+
+static void decodeCells( const std::vector<frame_t> &frames, cells_columns_t &columns, size_t from, size_t to ) {
+    uint16_t voltages[MAX_CELLS];
+
+    for( size_t row = from; row < to; row++ ) {
+        const uint8_t *frame = frames[row].data;
+        bool valid = isValid(frame);
+        size_t cells = frame[3] / 2;
+        columns.valid[row] = valid;
+        columns.time[row] = frames[row].time;
+        columns.pack[row] = frames[row].pack;
+        columns.cells[row] = valid ? cells : 0;
+        if( !valid ) {
+            continue;
+        }
+
+        swap16(&frame[4], voltages, cells);
+        for( size_t i = 0; i < MAX_CELLS; i++ ) {
+            columns.voltage[i][row] = (i < cells) ? voltages[i] : 0;
+        }
+    }
+}
+
+// Decode rows in parallel, each thread gets a contiguous range
+template <typename Columns, typename Decode>
+static void parallel( const std::vector<frame_t> &frames, Columns &columns, unsigned threads, Decode decode ) {
+    std::vector<std::thread> workers;
+    size_t rows = frames.size();
+    size_t step = (rows + threads - 1) / threads;
+
+    columns.resize(rows);
+    for( size_t from = 0; from < rows; from += step ) {
+        workers.emplace_back(decode, std::cref(frames), std::ref(columns), from, std::min(rows, from + step));
+    }
+    for( auto &worker : workers ) {
+        worker.join();
+    }
+}
+
+
+// Output
+
+static bool writeBytes( FILE *out, const void *data, size_t size ) {
+    return fwrite(data, 1, size, out) == size;
+}
+
+// Write valid rows of one column
+template <typename T>
+static bool writeColumn( FILE *out, const char *name, const std::vector<T> &values, const std::vector<uint8_t> &valid, 
+                         size_t rows, bool isSigned = std::is_signed<T>::value ) {
+    uint8_t len = strlen(name);
+    uint8_t type[2] = { (uint8_t)(isSigned ? 'i' : 'u'), (uint8_t)sizeof(T) };
+    bool ok = writeBytes(out, &len, 1) && writeBytes(out, name, len) && writeBytes(out, type, 2);
+
+    if( rows == values.size() ) {
+        return ok && writeBytes(out, values.data(), rows * sizeof(T));
+    }
+    std::vector<T> compact;
+    compact.reserve(rows);
+    for( size_t row = 0; row < values.size(); row++ ) {
+        if( valid[row] ) {
+            compact.push_back(values[row]);
+        }
+    }
+    return ok && writeBytes(out, compact.data(), rows * sizeof(T));
+}
+
+static bool writeGroupHeader( FILE *out, uint8_t table, uint32_t rows, uint16_t columns ) {
+    return writeBytes(out, &table, 1) && writeBytes(out, &rows, 4) && writeBytes(out, &columns, 2);
+}
+
+static bool writeStatus( FILE *out, const status_columns_t &columns, size_t rows ) {
+    static const char *words[] = { "voltage", "current", "remainingCapacity", "nominalCapacity", "cycles",
+                                   "productionDate", "balanceLow", "balanceHigh", "fault" };
+    static const char *bytes[] = { "version", "currentCapacity", "mosfetStatus", "cells", "ntcs" };
+    char name[16];
+
+    bool ok = writeGroupHeader(out, STATUS, rows, 2 + 9 + 5 + MAX_NTCS)
+        && writeColumn(out, "time", columns.time, columns.valid, rows)
+        && writeColumn(out, "pack", columns.pack, columns.valid, rows);
+    for( size_t i = 0; ok && i < 9; i++ ) {
+        ok = writeColumn(out, words[i], columns.words[i], columns.valid, rows, i == 1);  // current is signed
+    }
+    for( size_t i = 0; ok && i < 5; i++ ) {
+        ok = writeColumn(out, bytes[i], columns.bytes[i], columns.valid, rows);
+    }
+    for( size_t i = 0; ok && i < MAX_NTCS; i++ ) {
+        snprintf(name, sizeof(name), "temperature%u", (unsigned)i + 1);
+        ok = writeColumn(out, name, columns.temperature[i], columns.valid, rows);
+    }
+    return ok;
+}
+
+static bool writeCells( FILE *out, const cells_columns_t &columns, size_t rows ) {
+    char name[16];
+
+    bool ok = writeGroupHeader(out, CELLS, rows, 3 + MAX_CELLS)
+        && writeColumn(out, "time", columns.time, columns.valid, rows)
+        && writeColumn(out, "pack", columns.pack, columns.valid, rows)
+        && writeColumn(out, "cells", columns.cells, columns.valid, rows);
+    for( size_t i = 0; ok && i < MAX_CELLS; i++ ) {
+        snprintf(name, sizeof(name), "voltage%u", (unsigned)i + 1);
+        ok = writeColumn(out, name, columns.voltage[i], columns.valid, rows);
+    }
+    return ok;
+}
+
+static size_t countValid( const std::vector<uint8_t> &valid ) {
+    return std::count(valid.begin(), valid.end(), 1);
+}
+
+
+// Main
+
+static double seconds( std::chrono::steady_clock::time_point start ) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static int usage( const char *prog ) {
+    fprintf(stderr, "Usage: %s [-j threads] [--raw] [--bench] archive [columns.jbdc]\n", prog);
+    return 1;
+}
+
+// Decode first block with 1, 2, 4, ... threads and report frames per second
+static int bench( FILE *in, bool raw, unsigned maxThreads ) {
+    std::vector<uint8_t> buf(BLOCK_SIZE);
+    size_t size = fread(buf.data(), 1, buf.size(), in);
+    std::vector<frame_t> status, cells;
+    counts_t counts = {};
+    indexFrames(buf.data(), size, raw, status, cells, counts);
+    size_t frames = status.size() + cells.size();
+    if( !frames ) {
+        fprintf(stderr, "No frames found\n");
+        return 1;
+    }
+
+    status_columns_t statusColumns;
+    cells_columns_t cellsColumns;
+    std::vector<unsigned> steps;
+    for( unsigned threads = 1; threads < maxThreads; threads *= 2 ) {
+        steps.push_back(threads);
+    }
+    steps.push_back(maxThreads);
+
+    printf("{\"frames\":%zu,\"results\":[", frames);
+    for( unsigned threads : steps ) {
+        unsigned rounds = 0;
+        auto start = std::chrono::steady_clock::now();
+        do {
+            parallel(status, statusColumns, threads, decodeStatus);
+            parallel(cells, cellsColumns, threads, decodeCells);
+            rounds++;
+        } while( seconds(start) < 0.5 );
+        double rate = frames * rounds / seconds(start);
+        printf("%s\n {\"threads\":%u,\"frames_per_s\":%.0f,\"frames_per_s_per_thread\":%.0f}",
+            threads > 1 ? "," : "", threads, rate, rate / threads);
+    }
+    printf("]}\n");
+    return 0;
+}
+
+int main( int argc, char *argv[] ) {
+    unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+    bool raw = false, benchmark = false;
+    const char *inName = 0, *outName = 0;
+
+    for( int i = 1; i < argc; i++ ) {
+        if( !strcmp(argv[i], "-j") && i + 1 < argc ) {
+            threads = std::max(1, atoi(argv[++i]));
+        }
+        else if( !strcmp(argv[i], "--raw") ) {
+            raw = true;
+        }
+        else if( !strcmp(argv[i], "--bench") ) {
+            benchmark = true;
+        }
+        else if( !inName ) {
+            inName = argv[i];
+        }
+        else if( !outName ) {
+            outName = argv[i];
+        }
+        else {
+            return usage(argv[0]);
+        }
+    }
+    if( !inName ) {
+        return usage(argv[0]);
+    }
+
+    FILE *in = fopen(inName, "rb");
+    if( !in ) {
+        perror(inName);
+        return 1;
+    }
+    if( benchmark ) {
+        int rc = bench(in, raw, threads);
+        fclose(in);
+        return rc;
+    }
+
+    FILE *out = 0;
+    if( outName ) {
+        static const uint32_t version = 1;
+        out = fopen(outName, "wb");
+        if( !out || !writeBytes(out, "JBDC", 4) || !writeBytes(out, &version, sizeof(version)) ) {
+            perror(outName);
+            return 1;
+        }
+    }
+
+    std::vector<uint8_t> buf(BLOCK_SIZE);
+    std::vector<frame_t> status, cells;
+    status_columns_t statusColumns;
+    cells_columns_t cellsColumns;
+    counts_t counts = {};
+    size_t kept = 0;  // incomplete record from previous block
+    double decodeTime = 0;
+    auto start = std::chrono::steady_clock::now();
+
+    for( ;; ) {
+        size_t size = kept + fread(&buf[kept], 1, buf.size() - kept, in);
+        if( size == kept ) {
+            counts.skipped += kept;
+            break;
+        }
+
+        auto decodeStart = std::chrono::steady_clock::now();
+        status.clear();
+        cells.clear();
+        size_t used = indexFrames(buf.data(), size, raw, status, cells, counts);
+        parallel(status, statusColumns, threads, decodeStatus);
+        parallel(cells, cellsColumns, threads, decodeCells);
+        decodeTime += seconds(decodeStart);
+
+        size_t statusRows = countValid(statusColumns.valid);
+        size_t cellsRows = countValid(cellsColumns.valid);
+        counts.status += statusRows;
+        counts.cells += cellsRows;
+        counts.invalid += status.size() - statusRows + cells.size() - cellsRows;
+
+        if( out && ((statusRows && !writeStatus(out, statusColumns, statusRows))
+                 || (cellsRows && !writeCells(out, cellsColumns, cellsRows))) ) {
+            perror(outName);
+            return 1;
+        }
+
+        kept = size - used;
+        memmove(buf.data(), &buf[used], kept);
+    }
+
+    fclose(in);
+    if( out && fclose(out) ) {
+        perror(outName);
+        return 1;
+    }
+
+    uint64_t frames = counts.status + counts.cells + counts.invalid;
+    double rate = decodeTime > 0 ? frames / decodeTime : 0;
+    fprintf(stderr, "%llu status, %llu cells, %llu invalid frames, %llu skipped bytes in %.3f s\n",
+        (unsigned long long)counts.status, (unsigned long long)counts.cells,
+        (unsigned long long)counts.invalid, (unsigned long long)counts.skipped, seconds(start));
+    fprintf(stderr, "decode: %.0f frames/s with %u threads, %.0f frames/s per thread\n", rate, threads, rate / threads);
+    return 0;
+}
@@ -0,0 +1,116 @@
+#!/usr/bin/env python3
+"""
+Decode JbdLog entries into text
+
+Reads the formats from a header with JBDLOG_FORMAT(name, "format") lines (ids are
+assigned in order) and hex encoded entries as produced by JbdLog::encode(), one batch
+per "jbdlog <hex>" token, from files or stdin (e.g. a syslog file). Other text is ignored.
+Prints one line per entry: millis, priority, format name and the formatted text,
+or one json object per entry with --json.
+
+Usage: jbdlog.py [--json] logformats.h [syslog ...]
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+"""
+
+import fileinput
+import json
+import re
+import sys
+
+PRIORITIES = ["emerg", "alert", "crit", "err", "warning", "notice", "info", "debug"]
+
+FORMAT_RE = re.compile(r'JBDLOG_FORMAT\(\s*(\w+)\s*,((?:\s*"(?:[^"\\]|\\.)*")+)\s*\)')
+LITERAL_RE = re.compile(r'"((?:[^"\\]|\\.)*)"')
+SPEC_RE = re.compile(r'%%|%([-+ #0-9.]*)[hlLqjzt]*([diuxXoc])')
+ENTRY_RE = re.compile(r'jbdlog ([0-9a-f]+)')
+
+
+def read_formats(path):
+    """Return list of (name, format) in id order. Skips the example in comments"""
+    with open(path) as f:
+        text = re.sub(r'//[^\n]*|/\*.*?\*/', '', f.read(), flags=re.S)
+    formats = []
+    for name, literals in FORMAT_RE.findall(text):
+        fmt = "".join(LITERAL_RE.findall(literals))
+        formats.append((name, fmt.encode().decode("unicode_escape")))
+    return formats
+
+
+def varint(data, pos):
+    value = shift = 0
+    while True:
+        byte = data[pos]
+        pos += 1
+        value |= (byte & 0x7f) << shift
+        shift += 7
+        if not byte & 0x80:
+            return value & 0xffffffff, pos
+
+
+def entries(data):
+    """Yield (millis, priority, id, args) of a decoded batch"""
+    pos = 0
+    while pos < len(data):
+        length, ident, priority, argc = data[pos:pos + 4]
+        end = pos + 1 + length
+        pos += 4
+        millis, pos = varint(data, pos)
+        args = []
+        for _ in range(argc):
+            value, pos = varint(data, pos)
+            args.append(value)
+        pos = end
+        yield millis, priority, ident, args
+
+
+def convert(flags, conversion, value):
+    if conversion in "di":
+        value = value - (1 << 32) if value & 0x80000000 else value
+        conversion = "d"
+    elif conversion == "u":
+        conversion = "d"
+    return ("%" + flags + conversion) % value
+
+
+def format_entry(fmt, args):
+    """Same rules as JbdLog::format(): repeat the last conversion for extra arguments"""
+    args = list(args)
+    last = [None]
+
+    def replace(match):
+        if match.group(0) == "%%":
+            return "%"
+        last[0] = match.groups()
+        return convert(*last[0], args.pop(0)) if args else ""
+
+    text = SPEC_RE.sub(replace, fmt)
+    while args and last[0]:
+        text += "," + convert(*last[0], args.pop(0))
+    return text
+
+
+def decode(formats, lines, as_json=False):
+    for line in lines:
+        for batch in ENTRY_RE.findall(line):
+            for millis, priority, ident, args in entries(bytes.fromhex(batch)):
+                name, fmt = formats[ident] if ident < len(formats) else (str(ident), "")
+                text = format_entry(fmt, args)
+                prio = PRIORITIES[priority & 7]
+                if as_json:
+                    yield json.dumps({"millis": millis, "priority": prio, "format": name,
+                                      "args": args, "text": text})
+                else:
+                    yield "%10u %-7s %s %s" % (millis, prio, name, text)
+
+
+if __name__ == "__main__":
+    args = sys.argv[1:]
+    as_json = "--json" in args
+    args = [arg for arg in args if arg != "--json"]
+    if not args:
+        sys.exit(__doc__)
+    formats = read_formats(args[0])
+    for out in decode(formats, fileinput.input(args[1:]), as_json):
+        print(out)
@@ -0,0 +1,121 @@
+#!/usr/bin/env python3
+"""
+Decode JbdTelemetry frames to json
+
+Reads one hex encoded frame per line (as forwarded by a LoRa gateway or other uplink)
+from files or stdin. Text in front of the hex (e.g. a timestamp) is kept as "prefix".
+Prints one json object per frame. See include/jbdtelemetry.h for the frame format.
+
+Usage: jbdtelemetry.py [frames.txt ...] > samples.json
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+"""
+
+import fileinput
+import json
+import re
+
+VERSION = 1
+FAULT, BALANCE, STATUS, CELLS, DETAILS = 0x04, 0x08, 0x10, 0x20, 0x40
+
+FRAME_RE = re.compile(r'^(.*?)\b([0-9a-fA-F]{4,})\s*$')
+
+
+class Reader:
+    def __init__(self, frame):
+        self.frame = frame
+        self.pos = 0
+
+    def byte(self):
+        if self.pos >= len(self.frame):
+            raise ValueError("truncated frame")
+        self.pos += 1
+        return self.frame[self.pos - 1]
+
+    def varint(self):
+        value = shift = 0
+        while True:
+            byte = self.byte()
+            value |= (byte & 0x7f) << shift
+            shift += 7
+            if not byte & 0x80:
+                return value
+
+    def zigzag(self):
+        value = self.varint()
+        return (value >> 1) ^ -(value & 1)
+
+    def bits(self, count, width):
+        values = []
+        bits = have = 0
+        for _ in range(count):
+            while have < width:
+                bits |= self.byte() << have
+                have += 8
+            values.append(bits & ((1 << width) - 1))
+            bits >>= width
+            have -= width
+        return values
+
+
+def decode(frame):
+    r = Reader(frame)
+    version = r.byte()
+    if version != VERSION:
+        raise ValueError("unknown version %d" % version)
+    flags = r.byte()
+    sample = {"version": version}
+
+    if flags & STATUS:
+        status = {
+            "voltage": r.varint(),
+            "current": r.zigzag(),
+            "remainingCapacity": r.varint(),
+            "currentCapacity": r.byte(),
+            "cells": r.byte(),
+            "mosfetStatus": flags & 0x03,
+        }
+        temperatures = []
+        temperature = 0
+        for _ in range(r.byte()):
+            temperature += r.zigzag()
+            temperatures.append(temperature)
+        status["ntcs"] = len(temperatures)
+        status["temperatures"] = temperatures
+        if flags & DETAILS:
+            status["nominalCapacity"] = r.varint()
+            status["cycles"] = r.varint()
+            date = r.varint()
+            status["productionDate"] = "%04u-%02u-%02u" % ((date >> 9) + 2000, (date >> 5) & 0xf, date & 0x1f)
+            status["version"] = r.byte()
+        status["fault"] = r.varint() if flags & FAULT else 0
+        balance = 0
+        if flags & BALANCE:
+            for i in range(0, status["cells"], 8):
+                balance |= r.byte() << i
+        status["balance"] = "".join("1" if balance >> i & 1 else "0" for i in range(status["cells"]))
+        sample["Status"] = status
+
+    if flags & CELLS:
+        count = r.byte()
+        minimum = r.varint()
+        width = r.byte()
+        sample["Cells"] = [minimum + offset for offset in r.bits(count, width)]
+
+    sample["bytes"] = len(frame)
+    return sample
+
+
+if __name__ == "__main__":
+    for line in fileinput.input():
+        match = FRAME_RE.match(line.strip())
+        if not match:
+            continue
+        try:
+            sample = decode(bytes.fromhex(match.group(2)))
+        except ValueError as e:
+            sample = {"error": str(e)}
+        if match.group(1).strip():
+            sample["prefix"] = match.group(1).strip()
+        print(json.dumps(sample))
@@ -0,0 +1,54 @@
+#!/usr/bin/env python3
+"""
+Convert JbdTrace dumps into Chrome/Perfetto trace json
+
+Reads lines "jbdtrace,<micros>,<phase>,<command>" as printed by JbdTrace::dump()
+from files or stdin. Other lines (e.g. the rest of a serial log) are ignored.
+Each phase becomes a complete event lasting from the previous event to its own timestamp.
+Load the output in chrome://tracing or https://ui.perfetto.dev
+
+Usage: jbdtrace2chrome.py [serial.log ...] > trace.json
+
+Author: Joachim.Banzhaf@gmail.com
+License: GPL V2
+"""
+
+import fileinput
+import json
+import sys
+
+COMMANDS = {3: "status", 4: "cells", 5: "hardware", 0xe1: "mosfet"}
+
+
+def events(lines):
+    """Yield (us, phase, command) with micros() wraparounds removed"""
+    offset = 0
+    prev = None
+    for line in lines:
+        fields = line.strip().split(",")
+        if len(fields) != 4 or fields[0] != "jbdtrace":
+            continue
+        us = int(fields[1])
+        if prev is not None and us + offset < prev:
+            offset += 1 << 32
+        prev = us + offset
+        yield prev, fields[2], int(fields[3])
+
+
+def convert(lines):
+    trace = []
+    prev = None
+    for us, phase, command in events(lines):
+        name = COMMANDS.get(command, str(command))
+        if phase == "BEGIN" or prev is None:
+            trace.append({"name": name, "ph": "i", "s": "t", "ts": us, "pid": 1, "tid": 1})
+        else:
+            trace.append({"name": phase, "cat": name, "ph": "X", "ts": prev, "dur": us - prev,
+                          "pid": 1, "tid": 1, "args": {"command": command}})
+        prev = us
+    return {"traceEvents": trace, "displayTimeUnit": "ms"}
+
+
+if __name__ == "__main__":
+    json.dump(convert(fileinput.input()), sys.stdout, indent=1)
+    sys.stdout.write("\n")